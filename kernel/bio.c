@@ -1,10 +1,20 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NBUCKET buckets, each
+// with its own lock, so lookups of different blocks rarely contend.
+// bcache.lock is taken only to recycle, add or remove buffers.
+//
+// Buffer data lives in pages taken from kalloc(), PAGE_SIZE / BSIZE
+// buffers per page. binit() sizes the cache from the amount of free
+// memory; when kalloc() runs out of pages it calls bshrink() to take
+// back pages whose buffers are all unused, and bget() grows the cache
+// back towards its boot-time size once memory is free again.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -22,107 +32,330 @@
 #include "spinlock.h"
 #include "types.h"
 
-struct {
+#define NBUCKET 1021
+#define BUFS_PER_PAGE (PAGE_SIZE / BSIZE)
+#define NBUFPAGE (NBUF_MAX / BUFS_PER_PAGE)
+// at boot the cache gets this fraction of free memory.
+#define BCACHE_MEMFRAC 16
+
+// dev of a buffer that holds no block. Its blockno is its index
+// in bcache.buf[], so that it hashes to a unique (dev, blockno).
+#define NODEV ((uint)-1)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  // Null-terminated doubly-linked list of the buffers in this
+  // bucket, through prev/next.
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes recycling, growing and shrinking
+  struct buf buf[NBUF_MAX];
+  // page[i] holds the data of buf[i * BUFS_PER_PAGE] and its
+  // neighbours, or is 0 if those buffers are not in use.
+  char *page[NBUFPAGE];
+  int npage;   // number of non-zero page[] entries
+  int target;  // number of pages bget() grows the cache back to
+  int hand;    // CLOCK hand, an index into buf[]
+  struct bucket bucket[NBUCKET];
 } bcache;
 
+static struct bucket *hash(uint dev, uint blockno) {
+  return &bcache.bucket[(dev * 31 + blockno) % NBUCKET];
+}
+
+// Insert b into bucket bk. Caller must hold bk->lock.
+static void bucket_insert(struct bucket *bk, struct buf *b) {
+  b->prev = 0;
+  b->next = bk->head;
+  if (bk->head) bk->head->prev = b;
+  bk->head = b;
+}
+
+// Remove b from bucket bk. Caller must hold bk->lock.
+static void bucket_remove(struct bucket *bk, struct buf *b) {
+  if (b->prev)
+    b->prev->next = b->next;
+  else
+    bk->head = b->next;
+  if (b->next) b->next->prev = b->prev;
+}
+
+// Find a cached block in bk, taking a reference to it.
+// Caller must hold bk->lock.
+static struct buf *bucket_lookup(struct bucket *bk, uint dev, uint blockno) {
+  for (struct buf *b = bk->head; b != 0; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno) {
+      b->refcnt++;
+      b->used = 1;
+      return b;
+    }
+  }
+  return 0;
+}
+
+// Put page pa to use as the data of buffer group i.
+// Caller must hold bcache.lock.
+static void addpage(int i, char *pa) {
+  bcache.page[i] = pa;
+  bcache.npage++;
+  for (int j = 0; j < BUFS_PER_PAGE; j++) {
+    struct buf *b = &bcache.buf[i * BUFS_PER_PAGE + j];
+    b->data = (uchar *)pa + j * BSIZE;
+    b->dev = NODEV;
+    b->blockno = b - bcache.buf;
+    b->valid = 0;
+    b->refcnt = 0;
+    b->used = 0;
+    struct bucket *bk = hash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    bucket_insert(bk, b);
+    release(&bk->lock);
+  }
+}
+
+// Try to add one page of buffers, without taking pages
+// back from the buffer cache itself.
+// Returns 1 if the cache grew.
+static int bgrow(void) {
+  char *pa = kalloc_noreclaim();
+  if (pa == 0) return 0;
+
+  acquire(&bcache.lock);
+  for (int i = 0; i < NBUFPAGE; i++) {
+    if (bcache.page[i] == 0) {
+      addpage(i, pa);
+      release(&bcache.lock);
+      return 1;
+    }
+  }
+  release(&bcache.lock);
+  kfree(pa);
+  return 0;
+}
+
 void binit(void) {
   initlock(&bcache.lock, "bcache");
-
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for (struct buf *b = bcache.buf; b < bcache.buf + NBUF; b++) {
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+  for (struct bucket *bk = bcache.bucket; bk < &bcache.bucket[NBUCKET]; bk++)
+    initlock(&bk->lock, "bcache.bucket");
+  for (struct buf *b = bcache.buf; b < bcache.buf + NBUF_MAX; b++)
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+
+  int target = kfreepages() / BCACHE_MEMFRAC;
+  if (target < NBUF_MIN / BUFS_PER_PAGE) target = NBUF_MIN / BUFS_PER_PAGE;
+  if (target > NBUFPAGE) target = NBUFPAGE;
+  bcache.target = target;
+  while (bcache.npage < bcache.target) {
+    if (!bgrow()) panic("binit");
   }
+  printf("bcache: %d buffers\n", bcache.npage * BUFS_PER_PAGE);
+}
+
+// Choose an unused buffer with the CLOCK algorithm and unlink it
+// from its bucket. Returns 0 if every buffer is in use.
+// Caller must hold bcache.lock, which keeps other recyclers away and
+// fixes the (dev, blockno) of every buffer; bget() hits may still
+// race with us, so a candidate is re-checked under its bucket lock.
+static struct buf *bvictim(void) {
+  // two sweeps: the first may only clear used bits.
+  for (int n = 0; n < 2 * NBUF_MAX; n++) {
+    struct buf *b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUF_MAX;
+    if (bcache.page[(b - bcache.buf) / BUFS_PER_PAGE] == 0) continue;
+    if (b->refcnt != 0) continue;
+    if (b->used) {
+      b->used = 0;  // give it a second chance
+      continue;
+    }
+
+    struct bucket *bk = hash(b->dev, b->blockno);
+    acquire(&bk->lock);
+    if (b->refcnt == 0) {
+      bucket_remove(bk, b);
+      release(&bk->lock);
+      return b;
+    }
+    release(&bk->lock);
+  }
+  return 0;
 }
 
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf *bget(uint dev, uint blockno) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(dev, blockno);
+  struct buf *b;
 
   // Is the block already cached?
-  for (struct buf *b = bcache.head.next; b != &bcache.head; b = b->next) {
-    if (b->dev != dev || b->blockno != blockno) continue;
-    b->refcnt++;
-    release(&bcache.lock);
+  acquire(&bk->lock);
+  b = bucket_lookup(bk, dev, blockno);
+  release(&bk->lock);
+  if (b) {
     acquiresleep(&b->lock);
     return b;
   }
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for (struct buf *b = bcache.head.prev; b != &bcache.head; b = b->prev) {
-    if (b->refcnt != 0) continue;
-    b->dev = dev;
-    b->blockno = blockno;
-    b->valid = 0;
-    b->refcnt = 1;
+  // Not cached. Grow the cache if it shrank under memory
+  // pressure and memory is free again.
+  if (bcache.npage < bcache.target) bgrow();
+
+  for (;;) {
+    acquire(&bcache.lock);
+
+    // Another process may have cached the block while
+    // we were not holding the bucket lock.
+    acquire(&bk->lock);
+    b = bucket_lookup(bk, dev, blockno);
+    release(&bk->lock);
+    if (b) break;
+
+    // Recycle an unused buffer.
+    if ((b = bvictim()) != 0) {
+      b->dev = dev;
+      b->blockno = blockno;
+      b->valid = 0;
+      b->refcnt = 1;
+      b->used = 1;
+      acquire(&bk->lock);
+      bucket_insert(bk, b);
+      release(&bk->lock);
+      break;
+    }
+
+    // Every buffer is in use: the cache is too small.
+    release(&bcache.lock);
+    if (!bgrow()) panic("bget: no buffers");
+    acquire(&bcache.lock);
+    if (bcache.target < bcache.npage) bcache.target = bcache.npage;
     release(&bcache.lock);
-    acquiresleep(&b->lock);
-    return b;
   }
-  panic("bget: no buffers");
+
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Give up to n pages of unused buffers back to the page allocator.
+// Called by kalloc() when it runs out of memory, so the caller
+// must not hold bcache.lock or any bucket lock.
+// Returns the number of pages freed.
+int bshrink(int n) {
+  int freed = 0;
+
+  acquire(&bcache.lock);
+  for (int i = NBUFPAGE - 1; i >= 0 && freed < n; i--) {
+    if (bcache.page[i] == 0) continue;
+    if (bcache.npage * BUFS_PER_PAGE <= NBUF_MIN) break;
+
+    // lock every bucket holding one of the page's buffers.
+    // holding several bucket locks is safe under bcache.lock.
+    struct buf *group = &bcache.buf[i * BUFS_PER_PAGE];
+    struct bucket *bks[BUFS_PER_PAGE];
+    for (int j = 0; j < BUFS_PER_PAGE; j++) {
+      bks[j] = hash(group[j].dev, group[j].blockno);
+      int held = 0;
+      for (int k = 0; k < j; k++) held |= bks[k] == bks[j];
+      if (!held) acquire(&bks[j]->lock);
+    }
+
+    int busy = 0;
+    for (int j = 0; j < BUFS_PER_PAGE; j++) busy |= group[j].refcnt != 0;
+    if (!busy) {
+      for (int j = 0; j < BUFS_PER_PAGE; j++) bucket_remove(bks[j], &group[j]);
+    }
+
+    for (int j = 0; j < BUFS_PER_PAGE; j++) {
+      int held = 0;
+      for (int k = 0; k < j; k++) held |= bks[k] == bks[j];
+      if (!held) release(&bks[j]->lock);
+    }
+
+    if (!busy) {
+      kfree(bcache.page[i]);
+      bcache.page[i] = 0;
+      bcache.npage--;
+      freed++;
+    }
+  }
+  release(&bcache.lock);
+  return freed;
 }
 
 // Return a locked buf with the contents of the indicated block.
 struct buf *bread(uint dev, uint blockno) {
   struct buf *b = bget(dev, blockno);
   if (!b->valid) {
-    virtio_disk_rw(b, 0);
+    iorw(b, 0);
     b->valid = 1;
   }
   return b;
 }
 
+// Start reading the indicated block into the cache, if it is not
+// there, without waiting for the disk.
+void breadahead(uint dev, uint blockno) {
+  struct bucket *bk = hash(dev, blockno);
+  struct buf *b;
+
+  acquire(&bk->lock);
+  for (b = bk->head; b != 0; b = b->next) {
+    if (b->dev == dev && b->blockno == blockno) break;
+  }
+  release(&bk->lock);
+  if (b) return;  // cached, or being read
+
+  b = bget(dev, blockno);
+  if (b->valid)
+    brelse(b);
+  else
+    iostart(&b, 1, 0, breaddone);
+}
+
+// Called by the I/O scheduler when the read of b started by
+// breadahead() has finished. b's lock is released here,
+// on behalf of the process that started the read.
+void breaddone(struct buf *b) {
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
+  b->refcnt--;
+  release(&bk->lock);
+}
+
 // Write b's contents to disk.  Must be locked.
 void bwrite(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iorw(b, 1);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Mark it recently used for the CLOCK algorithm.
 void brelse(struct buf *b) {
   if (!holdingsleep(&b->lock)) panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-
-  release(&bcache.lock);
+  b->used = 1;
+  release(&bk->lock);
 }
 
 void bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
 
 void bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bk = hash(b->dev, b->blockno);
+  acquire(&bk->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  release(&bk->lock);
 }
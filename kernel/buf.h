@@ -9,7 +9,13 @@ struct buf {
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev;  // LRU cache list
+  int used;          // recently used? for CLOCK recycling
+  struct buf *prev;  // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  uchar *data;                 // BSIZE bytes, in a page of the buffer cache
+  struct buf *qnext;           // I/O scheduler queue, or disk request
+  int write;                   // queued for writing, not reading?
+  int ioq;                     // I/O scheduler queue it was started on
+  uint64 start;                // read_time() when it was started
+  void (*done)(struct buf *);  // called when the transfer finishes
 };
@@ -0,0 +1,138 @@
+// Directory name lookup cache.
+//
+// The name cache remembers the results of looking up names in
+// directories, keyed by (dev, directory inum, name), so that
+// namex() can walk a path without locking and reading each
+// directory on the way. An entry maps the name to the inode
+// number it names, or to 0 if the directory has no such name.
+//
+// Entries of a directory are added and removed only while the
+// directory is locked: namex() adds what dirlookup() found,
+// dirlink() adds new names, and sys_unlink() removes them. So
+// an entry cannot be added after the change that made it stale.
+// When a directory is freed, itrunc() drops all of its entries,
+// since its inode number may be reused. Entries are evicted by
+// the CLOCK algorithm when the cache is full.
+
+#include "defs.h"
+#include "fs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "types.h"
+
+#define NDCENTRY 512  // maximum number of cached names
+#define NDCBUCKET 127
+
+struct dentry {
+  uint dev;
+  uint dinum;           // the directory; 0 if the entry is free
+  char name[DIRSIZ];    // the name looked up in it
+  uint inum;            // the inode named, or 0 if name is absent
+  int used;             // referenced since the CLOCK hand last passed
+  struct dentry *next;  // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry dentry[NDCENTRY];
+  struct dentry *bucket[NDCBUCKET];
+  struct dentry *free;  // free entries, linked through next
+  int hand;             // CLOCK hand, an index into dentry[]
+} dcache;
+
+static struct dentry **hash(uint dev, uint dinum, char *name) {
+  uint h = dev * 31 + dinum * 17;
+  for (int i = 0; i < DIRSIZ && name[i]; i++) h = h * 31 + name[i];
+  return &dcache.bucket[h % NDCBUCKET];
+}
+
+void dcinit(void) {
+  initlock(&dcache.lock, "dcache");
+  for (struct dentry *d = dcache.dentry; d < &dcache.dentry[NDCENTRY]; d++) {
+    d->next = dcache.free;
+    dcache.free = d;
+  }
+}
+
+// Find the entry for name in directory (dev, dinum).
+// Caller must hold dcache.lock.
+static struct dentry *lookup(uint dev, uint dinum, char *name) {
+  for (struct dentry *d = *hash(dev, dinum, name); d != 0; d = d->next) {
+    if (d->dev == dev && d->dinum == dinum && namecmp(d->name, name) == 0)
+      return d;
+  }
+  return 0;
+}
+
+// Remove d from the cache. Caller must hold dcache.lock.
+static void evict(struct dentry *d) {
+  struct dentry **pp = hash(d->dev, d->dinum, d->name);
+  while (*pp != d) pp = &(*pp)->next;
+  *pp = d->next;
+  d->dinum = 0;
+  d->next = dcache.free;
+  dcache.free = d;
+}
+
+// If the lookup of name in directory (dev, dinum) is cached, set
+// *inum to the inode number it names, or to 0 if it names nothing,
+// and return 1. Return 0 if it is not cached.
+int dclookup(uint dev, uint dinum, char *name, uint *inum) {
+  acquire(&dcache.lock);
+  struct dentry *d = lookup(dev, dinum, name);
+  if (d) {
+    d->used = 1;
+    *inum = d->inum;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Remember that name in directory (dev, dinum) names inode inum,
+// or nothing if inum is 0. Caller must hold the directory's lock.
+void dcput(uint dev, uint dinum, char *name, uint inum) {
+  acquire(&dcache.lock);
+  struct dentry *d = lookup(dev, dinum, name);
+  if (d == 0) {
+    // two sweeps: the first may only clear used bits.
+    for (int n = 0; dcache.free == 0 && n < 2 * NDCENTRY; n++) {
+      struct dentry *v = &dcache.dentry[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDCENTRY;
+      if (v->used) {
+        v->used = 0;
+        continue;
+      }
+      evict(v);
+    }
+    d = dcache.free;
+    dcache.free = d->next;
+    d->dev = dev;
+    d->dinum = dinum;
+    strncpy(d->name, name, DIRSIZ);
+    struct dentry **bk = hash(dev, dinum, name);
+    d->next = *bk;
+    *bk = d;
+  }
+  d->inum = inum;
+  d->used = 1;
+  release(&dcache.lock);
+}
+
+// Forget the lookup of name in directory (dev, dinum), whose entry
+// for name is being removed. Caller must hold the directory's lock.
+void dcinval(uint dev, uint dinum, char *name) {
+  acquire(&dcache.lock);
+  struct dentry *d = lookup(dev, dinum, name);
+  if (d) evict(d);
+  release(&dcache.lock);
+}
+
+// Forget every lookup in directory (dev, dinum), which is being
+// freed.
+void dcdrop(uint dev, uint dinum) {
+  acquire(&dcache.lock);
+  for (struct dentry *d = dcache.dentry; d < &dcache.dentry[NDCENTRY]; d++) {
+    if (d->dinum == dinum && d->dev == dev) evict(d);
+  }
+  release(&dcache.lock);
+}
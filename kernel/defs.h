@@ -5,6 +5,7 @@
 
 struct buf;
 struct context;
+struct diskstat;
 struct file;
 struct inode;
 struct pipe;
@@ -13,6 +14,7 @@ struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void binit(void);
@@ -21,12 +23,22 @@ void brelse(struct buf*);
 void bwrite(struct buf*);
 void bpin(struct buf*);
 void bunpin(struct buf*);
+int bshrink(int);
+void breadahead(uint, uint);
+void breaddone(struct buf*);
 
 // console.c
 void consoleinit(void);
 void consoleintr(int);
 void consputc(int);
 
+// dcache.c
+void dcinit(void);
+int dclookup(uint, uint, char*, uint*);
+void dcput(uint, uint, char*, uint);
+void dcinval(uint, uint, char*);
+void dcdrop(uint, uint);
+
 // exec.c
 int exec(char*, char**);
 
@@ -41,10 +53,14 @@ int filewrite(struct file*, uint64, int n);
 
 // fs.c
 void fsinit(int);
+void bsealed(void);
+void dirinit(struct inode*, uint);
 int dirlink(struct inode*, char*, uint);
 struct inode* dirlookup(struct inode*, char*, uint*);
 struct inode* ialloc(uint, short);
 struct inode* idup(struct inode*);
+char* ipage(struct inode*, uint);
+uint ireadahead(struct inode*, uint, uint);
 void iinit();
 void ilock(struct inode*);
 void iput(struct inode*);
@@ -64,16 +80,40 @@ void ramdiskinit(void);
 void ramdiskintr(void);
 void ramdiskrw(struct buf*);
 
+// iosched.c
+void ioinit(void);
+void iostart(struct buf**, int, int, void (*)(struct buf*));
+void iodone(struct buf*, int);
+void iowait(struct buf*);
+void iopoll(struct buf*);
+void iorw(struct buf*, int);
+void iorwv(struct buf**, int, int, bool);
+void iostat(struct diskstat*);
+
 // kalloc.c
 void* kalloc(void);
+void* kalloc_noreclaim(void);
+void kdup(void*);
 void kfree(void*);
+int kfreepages(void);
+int krefcnt(void*);
 void kinit(void);
 
 // log.c
 void initlog(int, struct superblock*);
 void log_write(struct buf*);
+void log_data(struct buf*);
 void begin_op(void);
 void end_op(void);
+void log_sync(void);
+
+// pcache.c
+void pcinit(void);
+char* pcget(uint, uint, uint);
+void pcput(uint, uint, uint, char*);
+void pcwrite(uint, uint, uint, char*, uint);
+void pcdrop(uint, uint);
+int pcshrink(int);
 
 // pipe.c
 int pipealloc(struct file**, struct file**);
@@ -107,6 +147,8 @@ void userinit(void);
 int wait(uint64);
 void wakeup(void*);
 void yield(void);
+int kthread(char*, void (*)(void));
+void preempt(void);
 int either_copyout(int user_dst, uint64 dst, void* src, uint64 len);
 int either_copyin(void* dst, int user_src, uint64 src, uint64 len);
 void procdump(void);
@@ -168,10 +210,13 @@ PageTable uvmcreate(void);
 void uvminit(PageTable, uchar*, uint);
 uint64 uvmalloc(PageTable, uint64, uint64);
 uint64 uvmdealloc(PageTable, uint64, uint64);
-int uvmcopy(PageTable, PageTable, uint64);
+int uvmcopy(PageTable, PageTable, uint64, uint64);
+int uvmcow(PageTable, uint64);
+int uvmfault(struct proc*, uint64, bool);
 void uvmfree(PageTable, uint64);
 void uvmunmap(PageTable, uint64, uint64, int);
 void uvmclear(PageTable, uint64);
+PageTableEntry* walk(PageTable, uint64, bool);
 uint64 walkaddr(PageTable, uint64);
 int copyout(PageTable, uint64, char*, uint64);
 int copyin(PageTable, char*, uint64, uint64);
@@ -183,9 +228,21 @@ void plicinithart(void);
 int plic_claim(void);
 void plic_complete(int);
 
+// vma.c
+struct vma* vmalookup(struct proc*, uint64);
+struct vma* vmaoverlap(struct proc*, uint64, uint64);
+int vmafill(PageTable, struct vma*, uint64);
+void vmaprefault(struct proc*, uint64, uint64);
+void vmasync(PageTable, struct vma*);
+int vmadup(struct proc*, struct proc*);
+void vmaclear(PageTable, struct vma*);
+uint64 vmamap(struct proc*, uint64, int, int, struct file*, uint);
+int vmaunmap(struct proc*, uint64, uint64);
+
 // virtio_disk.c
 void virtio_disk_init(void);
-void virtio_disk_rw(struct buf*, int);
+int virtio_disk_submit(int, struct buf*, int, int);
+void virtio_disk_poll(int);
 void virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -0,0 +1,17 @@
+#include "kernel/types.h"
+
+#define NDISKLAT 16  // latency histogram buckets
+
+// Disk statistics, from diskstat().
+// Bucket i of a latency histogram counts the transfers that took
+// from 2^i up to 2^(i+1) microseconds to be seen done, from the
+// time they were started; bucket 0 also counts shorter ones, and
+// the last bucket longer ones.
+struct diskstat {
+  uint64 nread;               // blocks read
+  uint64 nwrite;              // blocks written
+  uint64 nreq;                // disk requests that transferred them
+  uint64 sleeplat[NDISKLAT];  // latency of transfers waited for asleep
+  uint64 polllat[NDISKLAT];   // latency of transfers waited for by polling
+  uint64 npollslept;          // polls that gave up and slept
+};
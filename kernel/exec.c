@@ -1,15 +1,16 @@
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
+#include "file.h"
+#include "fs.h"
 #include "memlayout.h"
 #include "param.h"
 #include "proc.h"
 #include "riscv.h"
+#include "sleeplock.h"
 #include "spinlock.h"
 #include "types.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset,
-                   uint sz);
-
 int exec(char *path, char **argv) {
   char *s, *last;
   int i, off;
@@ -18,8 +19,11 @@ int exec(char *path, char **argv) {
   struct inode *ip;
   struct proghdr ph;
   PageTable pagetable = 0, oldpagetable;
+  struct vma vma[NVMA];
+  int nvma = 0;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
   begin_op();
 
   if ((ip = namei(path)) == 0) {
@@ -34,17 +38,30 @@ int exec(char *path, char **argv) {
 
   if ((pagetable = proc_pagetable(p)) == 0) goto bad;
 
-  // Load program into memory.
+  // Record the program segments. Their pages are read
+  // from the file when the program first touches them.
   for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
     if (readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph)) goto bad;
     if (ph.type != ELF_PROG_LOAD) continue;
     if (ph.memsz < ph.filesz) goto bad;
     if (ph.vaddr + ph.memsz < ph.vaddr) goto bad;
-    uint64 sz1;
-    if ((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0) goto bad;
-    sz = sz1;
+    if (ph.vaddr + ph.memsz >= TRAPFRAME) goto bad;
     if (ph.vaddr % PAGE_SIZE != 0) goto bad;
-    if (loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0) goto bad;
+    if (ph.off + ph.filesz < ph.off || ph.off + ph.filesz > ip->size) goto bad;
+    if (ph.memsz == 0) continue;
+    if (nvma == NVMA) goto bad;
+    struct vma *v = &vma[nvma++];
+    v->start = ph.vaddr;
+    v->end = PAGE_ROUND_UP(ph.vaddr + ph.memsz);
+    v->ip = idup(ip);
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v->raoff = v->raend = ph.off;
+    v->perm = PAGE_TABLE_ENTRY_FLAGS_READABLE |
+              PAGE_TABLE_ENTRY_FLAGS_WRITABLE |
+              PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE;
+    v->flags = MAP_PRIVATE;
+    if (ph.vaddr + ph.memsz > sz) sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
@@ -98,39 +115,20 @@ int exec(char *path, char **argv) {
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp;          // initial stack pointer
+  vmasync(oldpagetable, p->vma);
+  begin_op();
+  vmaclear(oldpagetable, p->vma);
+  end_op();
   proc_freepagetable(oldpagetable, oldsz);
+  memmove(p->vma, vma, sizeof(vma));
 
   return argc;  // this ends up in a0, the first argument to main(argc, argv)
 
 bad:
+  if (ip == 0) begin_op();
+  vmaclear(pagetable, vma);
+  if (ip) iunlockput(ip);
+  end_op();
   if (pagetable) proc_freepagetable(pagetable, sz);
-  if (ip) {
-    iunlockput(ip);
-    end_op();
-  }
   return -1;
 }
-
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int loadseg(PageTable pagetable, uint64 va, struct inode *ip,
-                   uint offset, uint sz) {
-  uint i, n;
-  uint64 pa;
-
-  if ((va % PAGE_SIZE) != 0) panic("loadseg: va must be page aligned");
-
-  for (i = 0; i < sz; i += PAGE_SIZE) {
-    pa = walkaddr(pagetable, va + i);
-    if (pa == 0) panic("loadseg: address should exist");
-    if (sz - i < PAGE_SIZE)
-      n = sz - i;
-    else
-      n = PAGE_SIZE;
-    if (readi(ip, 0, (uint64)pa, offset + i, n) != n) return -1;
-  }
-
-  return 0;
-}
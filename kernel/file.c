@@ -97,7 +97,11 @@ int fileread(struct file *f, uint64 addr, int n) {
     r = devsw[f->major].read(1, addr, n);
   } else if (f->type == FD_INODE) {
     ilock(f->ip);
+    // a read that starts where the last one ended is sequential:
+    // keep the blocks from here on moving into the buffer cache.
+    if (f->off == f->raoff) f->raend = ireadahead(f->ip, f->off, f->raend);
     if ((r = readi(f->ip, 1, addr, f->off, n)) > 0) f->off += r;
+    f->raoff = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
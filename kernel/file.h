@@ -10,6 +10,8 @@ struct file {
   struct pipe *pipe;  // FD_PIPE
   struct inode *ip;   // FD_INODE and FD_DEVICE
   uint off;           // FD_INODE
+  uint raoff;         // FD_INODE: where the last read ended
+  uint raend;         // FD_INODE: where readahead has got to
   short major;        // FD_DEVICE
 };
 
@@ -30,7 +32,7 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT + 1];
+  uint addrs[NDIRECT + NLEVEL];
 };
 
 // map major device number to device functions.
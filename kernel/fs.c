@@ -34,36 +34,171 @@ static void readsb(int dev, struct superblock *sb) {
   brelse(bp);
 }
 
+static void bcount(int dev);
+
 // Init fs
 void fsinit(int dev) {
   readsb(dev, &sb);
   if (sb.magic != FSMAGIC) panic("invalid file system");
   initlog(dev, &sb);
+  bcount(dev);
 }
 
-// Zero a block.
-static void bzero(int dev, int bno) {
+// Zero a block, which holds file data if data is true.
+static void bzero(int dev, int bno, bool data) {
   struct buf *bp = bread(dev, bno);
   memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  if (data)
+    log_data(bp);
+  else
+    log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
-static uint balloc(uint dev) {
-  for (int b = 0; b < sb.size; b += BPB) {
+#define NBMAP 1024  // maximum number of bitmap blocks
+
+// Where balloc() starts looking when it is given no goal: after
+// the last block it allocated that way. Only a hint, so races
+// between allocations on different bitmap blocks are harmless.
+static uint bcursor;
+
+// Number of free blocks in each group of BPB blocks described by
+// one bitmap block, so that balloc() can pass over full groups
+// without reading their bitmap blocks. Counted by bcount() when
+// the file system is mounted, and afterwards changed only while
+// holding the group's bitmap block.
+static uint bfreecnt[NBMAP];
+
+// Blocks freed by the open log transaction, one bit per block,
+// which balloc() does not hand out again until the transaction
+// is sealed. Otherwise a freed indirect or directory block could
+// be reallocated as file data, which the flusher writes to its
+// home location before it commits the transaction: a crash before
+// the commit would leave the old, committed metadata pointing at
+// the new data. Once the transaction is sealed, data allocated in
+// later ones is written only after it commits. Like bfreecnt[],
+// the bits of a group are used only while holding its bitmap
+// block, and bsealed() clears them when no FS call is active.
+// bcount() allocates BSIZE bytes of bits per group, for the size
+// of the file system being mounted.
+static uint64 *bfreeing[NBMAP];
+static bool bfreeingset[NBMAP];  // any bits set in bfreeing[g]?
+
+// The kernel is not linked with libgcc, which the compiler's
+// bit-counting builtins may call, so count bits by hand.
+
+// Number of trailing zero bits of x, which must not be 0.
+static int ctz64(uint64 x) {
+  int n = 0;
+  for (int s = 32; s > 0; s >>= 1) {
+    if ((x & ((1ULL << s) - 1)) == 0) {
+      n += s;
+      x >>= s;
+    }
+  }
+  return n;
+}
+
+// Number of one bits of x.
+static int popcount64(uint64 x) {
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+  return (x * 0x0101010101010101ULL) >> 56;
+}
+
+// Number of blocks in the group described by bitmap block g;
+// only the last group may be short.
+static uint groupsize(uint g) { return min(BPB, sb.size - g * BPB); }
+
+// Fill in bfreecnt[] from the bitmap on disk, and allocate
+// bfreeing[].
+static void bcount(int dev) {
+  uint nbmap = (sb.size + BPB - 1) / BPB;
+  if (nbmap > NBMAP) panic("bcount: bitmap too big");
+
+  for (uint g = 0; g < nbmap; g++) {
+    if (g % (PAGE_SIZE / BSIZE) == 0) {
+      char *pa = kalloc();
+      if (pa == 0) panic("bcount: bfreeing");
+      memset(pa, 0, PAGE_SIZE);
+      for (uint j = 0; j < PAGE_SIZE / BSIZE && g + j < nbmap; j++)
+        bfreeing[g + j] = (uint64 *)(pa + j * BSIZE);
+    }
+    struct buf *bp = bread(dev, sb.bmapstart + g);
+    uint64 *w = (uint64 *)bp->data;
+    uint n = groupsize(g);
+    bfreecnt[g] = n;
+    for (uint i = 0; i * 64 < n; i++) {
+      uint64 used = w[i];
+      if (n - i * 64 < 64) used &= (1ULL << (n - i * 64)) - 1;
+      bfreecnt[g] -= popcount64(used);
+    }
+    brelse(bp);
+  }
+}
+
+// Called by the flusher when it seals a transaction, so that the
+// blocks the transaction freed may be allocated again.
+void bsealed(void) {
+  for (uint g = 0; g < NBMAP; g++) {
+    if (bfreeingset[g]) {
+      memset(bfreeing[g], 0, BSIZE);
+      bfreeingset[g] = false;
+    }
+  }
+}
+
+// Return the first clear bit of bitmap block data that is at or
+// after from and before to and is clear in freeing[] too, or -1
+// if there is none. Looks at 64 bits at a time.
+static int bfind(uchar *data, uint64 *freeing, uint from, uint to) {
+  uint64 *w = (uint64 *)data;
+  for (uint i = from / 64; i * 64 < to; i++) {
+    uint64 free = ~w[i] & ~freeing[i];
+    if (i == from / 64) free &= ~0ULL << (from % 64);
+    if (free) {
+      uint bi = i * 64 + ctz64(free);
+      return bi < to ? bi : -1;
+    }
+  }
+  return -1;
+}
+
+// Allocate a zeroed disk block, which will hold file data if data
+// is true, or metadata. Blocks freed by the open transaction are
+// not reused; see bfreeing[]. Takes the first free block at or after
+// goal, wrapping around the disk, or after bcursor if goal is 0.
+//
+// The BPREALLOC blocks after a new data block are kept for the
+// file's next blocks: bcursor is moved past them, so that blocks
+// allocated without a goal, such as the first blocks of other
+// files and indirect blocks, do not break up the file's run.
+static uint balloc(uint dev, uint goal, bool data) {
+  bool nogoal = goal == 0 || goal >= sb.size;
+  if (nogoal) goal = bcursor % sb.size;
+  uint nbmap = (sb.size + BPB - 1) / BPB;
+
+  // goal's bitmap block twice: from goal, and finally up to goal.
+  for (uint k = 0; k <= nbmap; k++) {
+    uint g = (goal / BPB + k) % nbmap;
+    uint b = g * BPB;
+    if (bfreecnt[g] == 0) continue;  // full; don't read its bitmap
     struct buf *bp = bread(dev, BBLOCK(b, sb));
-    for (int bi = 0; bi < BPB && b + bi < sb.size; bi++) {
-      int m = 1 << (bi % 8);
-      if ((bp->data[bi / 8] & m) == 0) {  // Is block free?
-        bp->data[bi / 8] |= m;            // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+    int bi = bfind(bp->data, bfreeing[g], k == 0 ? goal % BPB : 0,
+                   groupsize(g));
+    if (bi >= 0) {
+      bp->data[bi / 8] |= 1 << (bi % 8);  // Mark block in use.
+      bfreecnt[g]--;
+      log_write(bp);
+      brelse(bp);
+      if (nogoal) bcursor = b + bi + 1;
+      if (data && bcursor > b + bi && bcursor <= b + bi + BPREALLOC)
+        bcursor = b + bi + BPREALLOC + 1;
+      bzero(dev, b + bi, data);
+      return b + bi;
     }
     brelse(bp);
   }
@@ -77,6 +212,9 @@ static void bfree(int dev, uint b) {
   int m = 1 << (bi % 8);
   if ((bp->data[bi / 8] & m) == 0) panic("freeing free block");
   bp->data[bi / 8] &= ~m;
+  bfreecnt[b / BPB]++;
+  bfreeing[b / BPB][bi / 64] |= 1ULL << (bi % 64);
+  bfreeingset[b / BPB] = true;
   log_write(bp);
   brelse(bp);
 }
@@ -315,56 +453,96 @@ void iunlockput(struct inode *ip) {
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
 // listed in block ip->addrs[NDIRECT].
 
+// Are ip's data blocks ordered data, written outside the log?
+// A directory's contents are metadata, and are logged.
+static bool ordered(struct inode *ip) { return ip->type == T_FILE; }
+
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-static uint bmap(struct inode *ip, uint bn) {
+// If there is no such block, return 0, or if alloc is true allocate
+// one, at or after goal, along with any missing indirect blocks.
+static uint bwalk(struct inode *ip, uint bn, bool alloc, uint goal) {
   uint addr, *a;
   struct buf *bp;
 
   if (bn < NDIRECT) {
-    if ((addr = ip->addrs[bn]) == 0) ip->addrs[bn] = addr = balloc(ip->dev);
+    if ((addr = ip->addrs[bn]) == 0 && alloc)
+      ip->addrs[bn] = addr = balloc(ip->dev, goal, ordered(ip));
     return addr;
   }
   bn -= NDIRECT;
 
-  if (bn < NINDIRECT) {
-    // Load indirect block, allocating if necessary.
-    if ((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+  // find the tree that maps bn, and the number of blocks it maps.
+  int level = 0;
+  uint span = NINDIRECT;
+  while (bn >= span) {
+    bn -= span;
+    span *= NINDIRECT;
+    if (++level == NLEVEL) panic("bmap: out of range");
+  }
+
+  // Load the tree's indirect blocks, allocating if necessary.
+  if ((addr = ip->addrs[NDIRECT + level]) == 0) {
+    if (!alloc) return 0;
+    ip->addrs[NDIRECT + level] = addr = balloc(ip->dev, 0, false);
+  }
+  do {
+    span /= NINDIRECT;  // blocks mapped by each entry of this block
     bp = bread(ip->dev, addr);
     a = (uint *)bp->data;
-    if ((addr = a[bn]) == 0) {
-      a[bn] = addr = balloc(ip->dev);
+    if ((addr = a[bn / span]) == 0 && alloc) {
+      if (span == 1)
+        addr = balloc(ip->dev, goal, ordered(ip));
+      else
+        addr = balloc(ip->dev, 0, false);
+      a[bn / span] = addr;
       log_write(bp);
     }
     brelse(bp);
-    return addr;
-  }
+    bn %= span;
+  } while (span > 1 && addr != 0);
+  return addr;
+}
 
-  panic("bmap: out of range");
+// Return the disk block address of the nth block in inode ip.
+// If there is no such block, bmap allocates one, preferably the
+// block after the file's block bn-1, so that files that are
+// written sequentially are laid out contiguously.
+static uint bmap(struct inode *ip, uint bn) {
+  uint addr = bwalk(ip, bn, false, 0);
+  if (addr) return addr;
+
+  uint goal = bn > 0 ? bwalk(ip, bn - 1, false, 0) : 0;
+  return bwalk(ip, bn, true, goal ? goal + 1 : 0);
+}
+
+// Free block addr of a file, which is the root of a tree of indirect
+// blocks of the given depth, or a data block if depth is 0, and the
+// blocks that the tree maps.
+static void bfreetree(uint dev, uint addr, int depth) {
+  if (depth > 0) {
+    struct buf *bp = bread(dev, addr);
+    uint *a = (uint *)bp->data;
+    for (int j = 0; j < NINDIRECT; j++) {
+      if (a[j]) bfreetree(dev, a[j], depth - 1);
+    }
+    brelse(bp);
+  }
+  bfree(dev, addr);
 }
 
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void itrunc(struct inode *ip) {
-  for (int i = 0; i < NDIRECT; i++) {
+  pcdrop(ip->dev, ip->inum);
+  if (ip->type == T_DIR) dcdrop(ip->dev, ip->inum);
+
+  for (int i = 0; i < NDIRECT + NLEVEL; i++) {
     if (ip->addrs[i]) {
-      bfree(ip->dev, ip->addrs[i]);
+      bfreetree(ip->dev, ip->addrs[i], i < NDIRECT ? 0 : i - NDIRECT + 1);
       ip->addrs[i] = 0;
     }
   }
 
-  if (ip->addrs[NDIRECT]) {
-    struct buf *bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    uint *a = (uint *)bp->data;
-    for (int j = 0; j < NINDIRECT; j++) {
-      if (a[j]) bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
-  }
-
   ip->size = 0;
   iupdate(ip);
 }
@@ -379,6 +557,32 @@ void stati(struct inode *ip, struct stat *st) {
   st->size = ip->size;
 }
 
+// Return the page of the page cache that holds page pgno of
+// ip's data, reading it through the buffer cache if it is not
+// cached yet. Bytes past the end of the file read as zero.
+// The caller gets a reference to the page and must drop it
+// with kfree(). Returns 0 if out of memory.
+// Caller must hold ip->lock.
+char *ipage(struct inode *ip, uint pgno) {
+  char *pa = pcget(ip->dev, ip->inum, pgno);
+  if (pa) return pa;
+
+  if ((pa = kalloc()) == 0) return 0;
+  for (uint i = 0; i < PAGE_SIZE / BSIZE; i++) {
+    uint off = pgno * PAGE_SIZE + i * BSIZE;
+    char *dst = pa + i * BSIZE;
+    uint m = off < ip->size ? min(ip->size - off, BSIZE) : 0;
+    if (m > 0) {
+      struct buf *bp = bread(ip->dev, bmap(ip, off / BSIZE));
+      memmove(dst, bp->data, m);
+      brelse(bp);
+    }
+    memset(dst + m, 0, BSIZE - m);
+  }
+  pcput(ip->dev, ip->inum, pgno, pa);
+  return pa;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
@@ -390,6 +594,19 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
   if (off + n > ip->size) n = ip->size - off;
 
   for (tot = 0, m = 0; tot < n; tot += m, off += m, dst += m) {
+    char *page = ipage(ip, off / PAGE_SIZE);
+    if (page) {
+      m = min(n - tot, PAGE_SIZE - off % PAGE_SIZE);
+      int r = either_copyout(user_dst, dst, page + (off % PAGE_SIZE), m);
+      kfree(page);
+      if (r == -1) {
+        tot = -1;
+        break;
+      }
+      continue;
+    }
+
+    // out of memory: read the block through the buffer cache.
     struct buf *bp = bread(ip->dev, bmap(ip, off / BSIZE));
     m = min(n - tot, BSIZE - off % BSIZE);
     if (either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
@@ -402,6 +619,29 @@ int readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n) {
   return tot;
 }
 
+// Start reading the blocks of ip from offset off on into the buffer
+// cache without waiting for them, for a sequential reader at off.
+// end is the offset up to which blocks have already been started.
+// Once the reader is within NREADAHEAD/2 blocks of end, the next
+// blocks up to NREADAHEAD past off are started, so that the disk
+// stays busy without a lookup for every read. Stops at a hole in
+// the file. Returns the new end, which covers only the blocks that
+// were started.
+// Caller must hold ip->lock.
+uint ireadahead(struct inode *ip, uint off, uint end) {
+  if (end < off) end = off;
+  if (end - off >= NREADAHEAD / 2 * BSIZE) return end;
+
+  uint last = min(ip->size, off + NREADAHEAD * BSIZE);
+  for (uint bn = end / BSIZE; bn * BSIZE < last; bn++) {
+    uint addr = bwalk(ip, bn, false, 0);
+    if (addr == 0) break;
+    breadahead(ip->dev, addr);
+    end = min(last, (bn + 1) * BSIZE);
+  }
+  return end;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -422,7 +662,11 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    pcwrite(ip->dev, ip->inum, off, (char *)bp->data + (off % BSIZE), m);
+    if (ordered(ip))
+      log_data(bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
@@ -440,13 +684,286 @@ int writei(struct inode *ip, int user_src, uint64 src, uint off, uint n) {
 
 int namecmp(const char *s, const char *t) { return strncmp(s, t, DIRSIZ); }
 
+// Hash of a name, which picks its leaf in a hashed directory.
+// mkfs uses the same function.
+static uint dirhash(const char *name) {
+  uint h = 2166136261;  // 32-bit FNV-1a
+  for (int i = 0; i < DIRSIZ && name[i]; i++) {
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return the slot of name among the n entries de, or -1.
+static int dirscan(struct dirent *de, int n, char *name) {
+  for (int i = 0; i < n; i++) {
+    if (de[i].inum != 0 && namecmp(name, de[i].name) == 0) return i;
+  }
+  return -1;
+}
+
+// Log block bn of directory dp, which has been changed in its
+// buffer bp rather than with writei(), and update the page cache.
+static void dirlog(struct inode *dp, uint bn, struct buf *bp) {
+  pcwrite(dp->dev, dp->inum, bn * BSIZE, (char *)bp->data, BSIZE);
+  log_write(bp);
+}
+
+// If dp is a hashed directory, return its block 0, locked.
+// Return 0 if dp is a linear directory.
+static struct buf *dxroot(struct inode *dp) {
+  if (dp->size < BSIZE) return 0;
+  struct buf *bp = bread(dp->dev, bmap(dp, 0));
+  struct dxentry *dx = (struct dxentry *)bp->data + 2;
+  if (dx->inum == 0 && dx->magic == DXMAGIC) return bp;
+  brelse(bp);
+  return 0;
+}
+
+// Return the entries of the index held in block bn of a hashed
+// directory, whose buffer is bp.
+static struct dxentry *dxindex(uint bn, struct buf *bp) {
+  return (struct dxentry *)bp->data + (bn == 0 ? 2 : 0);
+}
+
+// Return the position in index dx of the entry holding hash h.
+static int dxfind(struct dxentry *dx, uint h) {
+  int lo = 0, hi = dx->nleaf - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (dx[mid].hash <= h)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Find the leaf for hash h in hashed directory dp, whose block 0
+// is bp0 and has at least one entry. Sets *pbn and *pbp to the
+// block holding the index that points to the leaf, and its buffer:
+// 0 and bp0, or an index block, locked. Returns the position of the
+// leaf's entry in that index.
+static int dxwalk(struct inode *dp, struct buf *bp0, uint h, uint *pbn,
+                  struct buf **pbp) {
+  struct dxentry *dx = dxindex(0, bp0);
+  int i = dxfind(dx, h);
+  *pbn = 0;
+  *pbp = bp0;
+  if (dx->depth > 0) {
+    *pbn = dx[i].leaf;
+    *pbp = bread(dp->dev, bmap(dp, *pbn));
+    i = dxfind(dxindex(*pbn, *pbp), h);
+  }
+  return i;
+}
+
+// Append a block to directory dp, and return it, zeroed and locked,
+// setting *pbn to its number within dp.
+static struct buf *dxappend(struct inode *dp, uint *pbn) {
+  *pbn = dp->size / BSIZE;
+  struct buf *bp = bread(dp->dev, bmap(dp, *pbn));  // zeroed by balloc()
+  dp->size += BSIZE;
+  iupdate(dp);
+  return bp;
+}
+
+// Look for name in hashed directory dp, whose block 0 is bp0,
+// and release bp0. If found, return the entry's inode number
+// and set *poff to its offset; otherwise return 0.
+static uint dxlookup(struct inode *dp, struct buf *bp0, char *name,
+                     uint *poff) {
+  struct dirent *de = (struct dirent *)bp0->data;
+  uint inum = 0, leaf = 0;
+
+  int i = dirscan(de, 2, name);  // "." or ".."
+  if (i >= 0) {
+    *poff = i * sizeof(*de);
+    inum = de[i].inum;
+  } else if (dxindex(0, bp0)->nleaf > 0) {
+    uint bn;
+    struct buf *bp;
+    i = dxwalk(dp, bp0, dirhash(name), &bn, &bp);
+    leaf = dxindex(bn, bp)[i].leaf;
+    if (bp != bp0) brelse(bp);
+  }
+  brelse(bp0);
+  if (leaf == 0) return inum;
+
+  struct buf *bp = bread(dp->dev, bmap(dp, leaf));
+  de = (struct dirent *)bp->data;
+  if ((i = dirscan(de, DPB, name)) >= 0) {
+    *poff = leaf * BSIZE + i * sizeof(*de);
+    inum = de[i].inum;
+  }
+  brelse(bp);
+  return inum;
+}
+
+// Make room in the full leaf at position i of the index held in
+// block bn of hashed directory dp, whose buffer is bp, by moving the
+// upper half of its hashes to a new leaf, or add dp's first leaf if
+// it has none. Returns 0, or -1 if every name in the leaf has the
+// same hash. The index must not be full.
+static int dxsplit(struct inode *dp, uint bn, struct buf *bp, int i) {
+  struct dxentry *dx = dxindex(bn, bp);
+  uint hash[DPB], sorted[DPB], split = 0;
+  struct buf *old = 0;
+
+  if (dx->nleaf > 0) {
+    old = bread(dp->dev, bmap(dp, dx[i].leaf));
+    struct dirent *de = (struct dirent *)old->data;
+    for (int j = 0; j < DPB; j++) {
+      hash[j] = dirhash(de[j].name);
+      int k = j;
+      for (; k > 0 && sorted[k - 1] > hash[j]; k--) sorted[k] = sorted[k - 1];
+      sorted[k] = hash[j];
+    }
+    // split at the median, unless that leaves the lower half empty.
+    int k = DPB / 2;
+    if (sorted[k] == sorted[0]) {
+      while (k < DPB && sorted[k] == sorted[0]) k++;
+      if (k == DPB) {
+        brelse(old);
+        return -1;
+      }
+    }
+    split = sorted[k];
+  }
+
+  uint newbn;
+  struct buf *new = dxappend(dp, &newbn);
+  if (old) {
+    struct dirent *from = (struct dirent *)old->data;
+    struct dirent *to = (struct dirent *)new->data;
+    for (int j = 0; j < DPB; j++) {
+      if (hash[j] >= split) {
+        *to++ = from[j];
+        memset(&from[j], 0, sizeof(from[j]));
+      }
+    }
+    dirlog(dp, dx[i].leaf, old);
+    brelse(old);
+    memmove(&dx[i + 2], &dx[i + 1], (dx->nleaf - i - 1) * sizeof(*dx));
+    dx[i + 1] = (struct dxentry){.hash = split, .leaf = newbn};
+  } else {
+    dx->leaf = newbn;
+  }
+  dx->nleaf++;
+  dirlog(dp, newbn, new);
+  brelse(new);
+  dirlog(dp, bn, bp);
+  return 0;
+}
+
+// Make room in the full index held in block bn of hashed directory
+// dp, whose buffer is bp, and whose block 0 is bp0. If the index is
+// block 0's, move its entries to an index block below it; otherwise
+// move the upper half of the index block's entries to a new one.
+// Returns 0, or -1 if block 0 has no room for another index block.
+static int dxgrow(struct inode *dp, struct buf *bp0, uint bn, struct buf *bp) {
+  struct dxentry *root = dxindex(0, bp0), *from = dxindex(bn, bp);
+
+  if (bn != 0 && root->nleaf == NDXLEAF) return -1;
+  uint newbn;
+  struct buf *new = dxappend(dp, &newbn);
+  struct dxentry *to = dxindex(newbn, new);
+  int n = from->nleaf, half = bn == 0 ? 0 : n / 2;
+  memmove(to, &from[half], (n - half) * sizeof(*to));
+  memset(&from[half], 0, (n - half) * sizeof(*from));
+  to->magic = DXMAGIC;
+  to->nleaf = n - half;
+
+  if (bn == 0) {
+    *root = (struct dxentry){
+        .magic = DXMAGIC, .depth = 1, .leaf = newbn, .nleaf = 1};
+  } else {
+    from->nleaf = half;
+    int i = dxfind(root, to->hash);
+    memmove(&root[i + 2], &root[i + 1], (root->nleaf - i - 1) * sizeof(*root));
+    root[i + 1] = (struct dxentry){.hash = to->hash, .leaf = newbn};
+    root->nleaf++;
+    dirlog(dp, bn, bp);
+  }
+  dirlog(dp, newbn, new);
+  brelse(new);
+  dirlog(dp, 0, bp0);
+  return 0;
+}
+
+// Add (name, inum) to hashed directory dp, whose block 0 is bp0,
+// and release bp0. Returns 0, or -1 if there is no room for it.
+static int dxlink(struct inode *dp, struct buf *bp0, char *name, uint inum) {
+  uint h = dirhash(name);
+  int r = -1;
+
+  if (dxindex(0, bp0)->nleaf == 0 && dxsplit(dp, 0, bp0, 0) < 0) {
+    brelse(bp0);
+    return -1;
+  }
+  for (;;) {
+    uint bn;
+    struct buf *bp;
+    int i = dxwalk(dp, bp0, h, &bn, &bp);
+    struct dxentry *dx = dxindex(bn, bp);
+    uint leaf = dx[i].leaf;
+    struct buf *lbp = bread(dp->dev, bmap(dp, leaf));
+    struct dirent *de = (struct dirent *)lbp->data;
+    int j = 0;
+    while (j < DPB && de[j].inum != 0) j++;
+    if (j < DPB) {
+      de[j].inum = inum;
+      strncpy(de[j].name, name, DIRSIZ);
+      dirlog(dp, leaf, lbp);
+      r = 0;
+    }
+    brelse(lbp);
+    int room = -1;  // whether trying again may find room
+    if (r < 0 && dx->nleaf < (bn == 0 ? NDXLEAF : DPB))
+      room = dxsplit(dp, bn, bp, i);
+    else if (r < 0)
+      room = dxgrow(dp, bp0, bn, bp);
+    if (bp != bp0) brelse(bp);
+    if (room < 0) break;
+  }
+  brelse(bp0);
+  return r;
+}
+
+// Make the new, empty directory dp a hashed directory holding
+// "." and "..", the latter a link to inode parent.
+// Caller must hold dp->lock.
+void dirinit(struct inode *dp, uint parent) {
+  struct buf *bp = bread(dp->dev, bmap(dp, 0));
+  struct dirent *de = (struct dirent *)bp->data;
+  de[0].inum = dp->inum;
+  strncpy(de[0].name, ".", DIRSIZ);
+  de[1].inum = parent;
+  strncpy(de[1].name, "..", DIRSIZ);
+  struct dxentry *dx = (struct dxentry *)bp->data + 2;
+  dx->magic = DXMAGIC;
+  dirlog(dp, 0, bp);
+  brelse(bp);
+  dp->size = BSIZE;
+  iupdate(dp);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
   struct dirent de;
+  struct buf *bp;
 
   if (dp->type != T_DIR) panic("dirlookup not DIR");
 
+  if ((bp = dxroot(dp)) != 0) {
+    uint off, inum = dxlookup(dp, bp, name, &off);
+    if (inum == 0) return 0;
+    if (poff) *poff = off;
+    return iget(dp->dev, inum);
+  }
+
   for (uint off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -463,10 +980,12 @@ struct inode *dirlookup(struct inode *dp, char *name, uint *poff) {
 }
 
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns 0, or -1 if name is present or there is no room for it.
 int dirlink(struct inode *dp, char *name, uint inum) {
   int off;
   struct dirent de;
   struct inode *ip;
+  struct buf *bp;
 
   // Check that name is not present.
   if ((ip = dirlookup(dp, name, 0)) != 0) {
@@ -474,6 +993,12 @@ int dirlink(struct inode *dp, char *name, uint inum) {
     return -1;
   }
 
+  if ((bp = dxroot(dp)) != 0) {
+    if (dxlink(dp, bp, name, inum) < 0) return -1;
+    dcput(dp->dev, dp->inum, name, inum);
+    return 0;
+  }
+
   // Look for an empty dirent.
   for (off = 0; off < dp->size; off += sizeof(de)) {
     if (readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -485,6 +1010,7 @@ int dirlink(struct inode *dp, char *name, uint inum) {
   de.inum = inum;
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcput(dp->dev, dp->inum, name, inum);
 
   return 0;
 }
@@ -522,6 +1048,28 @@ static char *skipelem(char *path, char *name) {
   return path;
 }
 
+// Look up name in directory dp in the name cache, without locking
+// dp. On a hit, set *ipp to the inode that name names, or to 0 if
+// there is no such name, and return 1. Return 0 on a miss.
+static int dircached(struct inode *dp, char *name, struct inode **ipp) {
+  uint inum, again;
+
+  if (!dclookup(dp->dev, dp->inum, name, &inum)) return 0;
+  if (inum == 0) {
+    *ipp = 0;
+    return 1;
+  }
+  // name may be unlinked, and its inode freed, before iget() takes
+  // a reference; if the entry is still cached afterwards, it was not.
+  struct inode *ip = iget(dp->dev, inum);
+  if (!dclookup(dp->dev, dp->inum, name, &again) || again != inum) {
+    iput(ip);
+    return 0;
+  }
+  *ipp = ip;
+  return 1;
+}
+
 // Look up and return the inode for a path name.
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
@@ -532,6 +1080,14 @@ static struct inode *namex(char *path, int nameiparent, char *name) {
   ip = *path == '/' ? iget(ROOTDEV, ROOTINO) : idup(myproc()->cwd);
 
   while ((path = skipelem(path, name)) != 0) {
+    // a cached lookup needs no lock: ip has cached entries
+    // only if it is a directory.
+    if (!(nameiparent && *path == '\0') && dircached(ip, name, &next)) {
+      iput(ip);
+      if (next == 0) return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if (ip->type != T_DIR) {
       iunlockput(ip);
@@ -542,7 +1098,9 @@ static struct inode *namex(char *path, int nameiparent, char *name) {
       iunlock(ip);
       return ip;
     }
-    if ((next = dirlookup(ip, name, 0)) == 0) {
+    next = dirlookup(ip, name, 0);
+    dcput(ip->dev, ip->inum, name, next ? next->inum : 0);
+    if (next == 0) {
       iunlockput(ip);
       return 0;
     }
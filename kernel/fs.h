@@ -27,18 +27,32 @@ struct superblock {
 
 #define FSMAGIC 0x10203040
 
-#define NDIRECT 12
+// The log is a tail block followed by a circular sequence of
+// records, one per transaction. A record of n logged blocks starts
+// with a header of LOGHEAD(n) blocks: four words, then the n blocks'
+// block numbers. A log of nlog blocks holds transactions of up to
+// LOGTXMAX(nlog) blocks.
+#define LOGHEAD(n) ((((n) + 4) * sizeof(uint) + BSIZE - 1) / BSIZE)
+#define LOGTXMAX(nlog) ((nlog) - 1 - LOGHEAD(nlog))
+
+// An inode maps its first NDIRECT blocks directly, and the rest
+// through NLEVEL trees of indirect blocks: addrs[NDIRECT + i] is the
+// root of a tree of depth i+1, which maps NINDIRECT^(i+1) blocks.
+#define NDIRECT 10
+#define NLEVEL 3
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define MAXFILE                                  \
+  (NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT + \
+   NINDIRECT * NINDIRECT * NINDIRECT)
 
 // On-disk inode structure
 struct dinode {
-  short type;               // File type
-  short major;              // Major device number (T_DEVICE only)
-  short minor;              // Minor device number (T_DEVICE only)
-  short nlink;              // Number of links to inode in file system
-  uint size;                // Size of file (bytes)
-  uint addrs[NDIRECT + 1];  // Data block addresses
+  short type;                    // File type
+  short major;                   // Major device number (T_DEVICE only)
+  short minor;                   // Minor device number (T_DEVICE only)
+  short nlink;                   // Number of links to inode in file system
+  uint size;                     // Size of file (bytes)
+  uint addrs[NDIRECT + NLEVEL];  // Data block addresses
 };
 
 // Inodes per block.
@@ -61,4 +75,36 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// Directory entries per block.
+#define DPB (BSIZE / sizeof(struct dirent))
+
+// A hashed directory keeps its entries in leaf blocks, each holding
+// the names whose dirhash() lies in some range. Block 0 holds "." and
+// "..", followed by an index of the leaves in place of the remaining
+// dirents: entry i says that leaf block leaf of the directory holds
+// the hashes from hash up to the next entry's hash. The first entry
+// has magic DXMAGIC, which marks the directory as hashed, depth 0, and
+// the number of leaves. Index entries have inum 0, so that programs
+// reading the directory as a sequence of dirents, like ls, skip them.
+// A directory without DXMAGIC is linear: one unordered sequence.
+//
+// When block 0 has no room for another leaf, the directory grows a
+// second level: the index in block 0 gets depth 1, and its entries
+// point to index blocks rather than to leaves. An index block fills a
+// whole block with entries laid out like block 0's, and its first
+// entry likewise holds the number of entries.
+#define DXMAGIC 0x4458
+#define NDXLEAF (DPB - 2)  // maximum number of entries in block 0
+
+struct dxentry {
+  ushort inum;   // always 0
+  ushort magic;  // DXMAGIC in the first entry
+  union {
+    uint hash;   // least hash of the names below the entry
+    uint depth;  // index levels below block 0's, in its first entry
+  };
+  uint leaf;   // block number of the leaf or index block
+  uint nleaf;  // number of entries, in the first entry
+};
+
 #endif
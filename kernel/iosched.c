@@ -0,0 +1,204 @@
+// I/O scheduler.
+//
+// Disk transfers of buffers go through a queue kept sorted by block
+// number rather than straight to the disk driver. The disk is given
+// at most IODEPTH requests at a time; the queued buffers are sent to
+// it in elevator order (upwards from the last block sent, then back
+// to the lowest queued block), and a run of queued buffers holding
+// consecutive blocks and going the same way becomes one request of
+// up to IOMAXSEG blocks. So a burst of I/O, such as a log commit or
+// readahead, reaches the disk as a few large requests.
+//
+// Each CPU has its own queue, feeding its own queue of the disk,
+// so that CPUs doing I/O at the same time do not contend for one
+// lock. A transfer stays in the queue of the CPU that started it.
+//
+// Interface:
+// * iostart() queues buffers for reading or writing and returns.
+// * When a buffer's transfer finishes, its done function is
+//   called, or, if it has none, iowait() on it returns.
+// * iopoll() waits like iowait(), but first spins for a while
+//   checking the disk for the completion itself, which saves the
+//   sleep and wakeup when the disk is fast.
+// * iorw() and iorwv() start transfers and wait for them.
+
+#include "buf.h"
+#include "defs.h"
+#include "diskstat.h"
+#include "fs.h"
+#include "param.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "types.h"
+
+#define IODEPTH 8       // requests of one queue the disk works on at once
+#define IOPOLL_US 100   // longest iopoll() spins before sleeping
+#define TIME_PER_US 10  // read_time() ticks per microsecond, in qemu
+
+struct ioqueue {
+  struct spinlock lock;
+  struct buf *queue;  // queued buffers, sorted by blockno, through qnext
+  uint pos;           // block after the last one sent to the disk
+  int busy;           // requests the disk is working on
+  struct diskstat st;
+} __attribute__((aligned(64)));  // one cache line per CPU
+
+struct ioqueue ioqueue[CPU_MAX_NUM];
+
+void ioinit(void) {
+  for (int i = 0; i < CPU_MAX_NUM; i++)
+    initlock(&ioqueue[i].lock, "iosched");
+}
+
+// Send buffers queued in q to the disk while it has fewer than
+// IODEPTH of q's requests. Caller must hold q->lock.
+static void dispatch(struct ioqueue *q) {
+  while (q->queue && q->busy < IODEPTH) {
+    // the first buffer at or above pos, or else the lowest.
+    struct buf **pp = &q->queue;
+    while (*pp && (*pp)->blockno < q->pos) pp = &(*pp)->qnext;
+    if (*pp == 0) pp = &q->queue;
+
+    // merge the buffers after it that continue its run.
+    struct buf *b = *pp, *last = b;
+    int n = 1;
+    while (n < IOMAXSEG && last->qnext && last->qnext->dev == b->dev &&
+           last->qnext->blockno == last->blockno + 1 &&
+           last->qnext->write == b->write) {
+      last = last->qnext;
+      n++;
+    }
+    if (virtio_disk_submit(q - ioqueue, b, n, b->write) < 0) break;
+    *pp = last->qnext;
+    last->qnext = 0;
+
+    q->pos = last->blockno + 1;
+    q->busy++;
+    q->st.nreq++;
+    if (b->write)
+      q->st.nwrite += n;
+    else
+      q->st.nread += n;
+  }
+}
+
+// Queue the n buffers bs[] to be read from or written to disk,
+// and return without waiting for the transfers. When the one for
+// buffer b finishes, done(b) is called, with a queue lock held, so
+// it must not sleep or start more transfers; if done is 0,
+// iowait(b) returns. The buffers need not be in the buffer cache.
+void iostart(struct buf **bs, int n, int write, void (*done)(struct buf *)) {
+  push_off();
+  int id = cpuid();
+  pop_off();
+  // if we move to another CPU now, we only use its queue.
+  struct ioqueue *q = &ioqueue[id];
+
+  acquire(&q->lock);
+  for (int i = 0; i < n; i++) {
+    struct buf *b = bs[i];
+    b->ioq = id;
+    b->start = read_time();
+    b->disk = 1;
+    b->write = write;
+    b->done = done;
+    // behind any queued buffers for the same block, which
+    // must reach the disk first.
+    struct buf **pp = &q->queue;
+    while (*pp && (*pp)->blockno <= b->blockno) pp = &(*pp)->qnext;
+    b->qnext = *pp;
+    *pp = b;
+  }
+  dispatch(q);
+  release(&q->lock);
+}
+
+// Called by the disk driver when the request for b and the n-1
+// buffers after it on qnext has finished.
+void iodone(struct buf *b, int n) {
+  struct ioqueue *q = &ioqueue[b->ioq];
+
+  acquire(&q->lock);
+  for (int i = 0; i < n; i++) {
+    struct buf *next = b->qnext;
+    b->qnext = 0;
+    b->disk = 0;
+    if (b->done)
+      b->done(b);
+    else
+      wakeup(b);
+    b = next;
+  }
+  q->busy--;
+  dispatch(q);
+  release(&q->lock);
+}
+
+// Sleep until the transfer of b is done, and count the time
+// since it was started in the histogram lat[].
+static void waitfor(struct buf *b, uint64 *lat) {
+  struct ioqueue *q = &ioqueue[b->ioq];
+
+  acquire(&q->lock);
+  while (b->disk) sleep(b, &q->lock);
+  uint64 us = (read_time() - b->start) / TIME_PER_US;
+  int i = 0;
+  while (us > 1 && i < NDISKLAT - 1) {
+    us >>= 1;
+    i++;
+  }
+  lat[i]++;
+  release(&q->lock);
+}
+
+// Wait for the transfer of b, started with no done function,
+// to finish.
+void iowait(struct buf *b) { waitfor(b, ioqueue[b->ioq].st.sleeplat); }
+
+// Like iowait(), but spin for up to IOPOLL_US, handling the
+// disk's completions, before sleeping.
+void iopoll(struct buf *b) {
+  struct ioqueue *q = &ioqueue[b->ioq];
+
+  uint64 stop = read_time() + IOPOLL_US * TIME_PER_US;
+  while (b->disk && read_time() < stop) virtio_disk_poll(b->ioq);
+  if (b->disk) {
+    acquire(&q->lock);
+    q->st.npollslept++;
+    release(&q->lock);
+  }
+  waitfor(b, q->st.polllat);
+}
+
+// Read or write the n buffers bs[] as one batch, and wait for
+// them all, polling if poll is set. The buffers need not be in
+// the buffer cache.
+void iorwv(struct buf **bs, int n, int write, bool poll) {
+  iostart(bs, n, write, 0);
+  for (int i = 0; i < n; i++) {
+    if (poll)
+      iopoll(bs[i]);
+    else
+      iowait(bs[i]);
+  }
+}
+
+void iorw(struct buf *b, int write) { iorwv(&b, 1, write, false); }
+
+// Copy the disk statistics, summed over the queues, into *st.
+void iostat(struct diskstat *st) {
+  memset(st, 0, sizeof(*st));
+  for (struct ioqueue *q = ioqueue; q < &ioqueue[CPU_MAX_NUM]; q++) {
+    acquire(&q->lock);
+    st->nread += q->st.nread;
+    st->nwrite += q->st.nwrite;
+    st->nreq += q->st.nreq;
+    st->npollslept += q->st.npollslept;
+    for (int i = 0; i < NDISKLAT; i++) {
+      st->sleeplat[i] += q->st.sleeplat[i];
+      st->polllat[i] += q->st.polllat[i];
+    }
+    release(&q->lock);
+  }
+}
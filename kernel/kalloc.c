@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps a private cache of free pages so that kalloc() and
+// kfree() normally touch only that CPU's lock and cache line. Pages
+// move between the CPU caches and a shared pool in batches: a CPU
+// refills from the pool when its cache is empty and drains a batch
+// back when its cache grows too large. If both the local cache and
+// the pool are empty, kalloc() steals from another CPU's cache, and
+// failing that takes unused pages back from the page cache and the
+// buffer cache.
+//
+// Pages may be shared, e.g. copy-on-write after fork(). Each page
+// has a reference count: kalloc() sets it to 1, kdup() increments
+// it, and kfree() frees the page only when the count drops to 0.
 
 #include "defs.h"
 #include "memlayout.h"
@@ -9,6 +22,11 @@
 #include "spinlock.h"
 #include "types.h"
 
+// number of pages moved between a CPU cache and the shared pool at once.
+#define KMEM_BATCH 32
+// a CPU cache holding more than this many pages drains a batch.
+#define KMEM_HIGH (KMEM_BATCH * 4)
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[];  // first address after kernel.
@@ -18,53 +36,200 @@ struct run {
   struct run *next;
 };
 
-struct {
+// reference counts of physical pages, updated with atomic operations.
+static int refcount[(PHYSTOP - KERNBASE) / PAGE_SIZE];
+#define PA2REF(pa) (&refcount[((uint64)(pa)-KERNBASE) / PAGE_SIZE])
+
+// Free list of one CPU. Only that CPU allocates from or frees to it;
+// other CPUs take its lock only to steal pages.
+struct kmem_cpu {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+} __attribute__((aligned(64)));  // one cache line per CPU
+
+struct {
+  struct spinlock lock;  // protects the shared pool
+  struct run *freelist;
+  int nfree;
+  struct kmem_cpu cpus[CPU_MAX_NUM];
 } kmem;
 
 void kinit() {
   initlock(&kmem.lock, "kmem");
+  for (int i = 0; i < CPU_MAX_NUM; i++)
+    initlock(&kmem.cpus[i].lock, "kmem_cpu");
   freerange(end, (void *)PHYSTOP);
 }
 
 void freerange(void *pa_start, void *pa_end) {
   for (char *p = (char *)PAGE_ROUND_UP((uint64)pa_start);
-       p + PAGE_SIZE <= (char *)pa_end; p += PAGE_SIZE)
+       p + PAGE_SIZE <= (char *)pa_end; p += PAGE_SIZE) {
+    *PA2REF(p) = 1;
     kfree(p);
+  }
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain and sets *got to its length.
+static struct run *takepages(struct run **list, int n, int *got) {
+  struct run *head = *list, *tail = 0;
+  int i;
+
+  for (i = 0; i < n && *list; i++) {
+    tail = *list;
+    *list = tail->next;
+  }
+  if (tail) tail->next = 0;
+  *got = i;
+  return i ? head : 0;
 }
 
-// Free the page of physical memory pointed at by v,
+// Push a chain of n pages onto the front of *list.
+static void putpages(struct run **list, struct run *chain, int n) {
+  if (chain == 0) return;
+  struct run *tail = chain;
+  for (int i = 1; i < n; i++) tail = tail->next;
+  tail->next = *list;
+  *list = chain;
+}
+
+// Take pages from some other CPU's cache into c's.
+// Called without c->lock held, so that two CPUs stealing
+// from each other cannot deadlock.
+static void steal(struct kmem_cpu *c) {
+  for (struct kmem_cpu *v = kmem.cpus; v < &kmem.cpus[CPU_MAX_NUM]; v++) {
+    if (v == c) continue;
+    acquire(&v->lock);
+    int got;
+    // take half of the victim's pages, so it is not left empty.
+    struct run *chain = takepages(&v->freelist, (v->nfree + 1) / 2, &got);
+    v->nfree -= got;
+    release(&v->lock);
+    if (got == 0) continue;
+
+    acquire(&c->lock);
+    putpages(&c->freelist, chain, got);
+    c->nfree += got;
+    release(&c->lock);
+    return;
+  }
+}
+
+// Drop a reference to the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference is dropped.
 void kfree(void *pa) {
-  struct run *r;
-
   if (((uint64)pa % PAGE_SIZE) != 0 || (char *)pa < end ||
       (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  int ref = __sync_sub_and_fetch(PA2REF(pa), 1);
+  if (ref < 0) panic("kfree: refcount");
+  if (ref > 0) return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PAGE_SIZE);
 
-  r = (struct run *)pa;
+  struct run *r = (struct run *)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  struct kmem_cpu *c = &kmem.cpus[cpuid()];
+  acquire(&c->lock);
+  r->next = c->freelist;
+  c->freelist = r;
+  c->nfree++;
+  if (c->nfree > KMEM_HIGH) {
+    // too many cached pages; return a batch to the shared pool.
+    int got;
+    struct run *chain = takepages(&c->freelist, KMEM_BATCH, &got);
+    c->nfree -= got;
+    acquire(&kmem.lock);
+    putpages(&kmem.freelist, chain, got);
+    kmem.nfree += got;
+    release(&kmem.lock);
+  }
+  release(&c->lock);
+  pop_off();
+}
+
+// Take a page from this CPU's cache, refilling it from the shared
+// pool or from other CPUs if it is empty. Returns 0 if there are
+// no free pages anywhere.
+static void *allocpage(void) {
+  push_off();
+  struct kmem_cpu *c = &kmem.cpus[cpuid()];
+
+  acquire(&c->lock);
+  if (c->freelist == 0) {
+    // refill a batch from the shared pool.
+    int got;
+    acquire(&kmem.lock);
+    struct run *chain = takepages(&kmem.freelist, KMEM_BATCH, &got);
+    kmem.nfree -= got;
+    release(&kmem.lock);
+    putpages(&c->freelist, chain, got);
+    c->nfree += got;
+  }
+  if (c->freelist == 0) {
+    release(&c->lock);
+    steal(c);
+    acquire(&c->lock);
+  }
+  struct run *r = c->freelist;
+  if (r) {
+    c->freelist = r->next;
+    c->nfree--;
+  }
+  release(&c->lock);
+  pop_off();
+
+  if (r) {
+    *PA2REF(r) = 1;
+    memset((char *)r, 5, PAGE_SIZE);  // fill with junk
+  }
+  return (void *)r;
 }
 
+// Allocate one 4096-byte page of physical memory, without
+// shrinking the buffer cache. Used by the buffer cache itself,
+// which holds its locks while it would be shrunk.
+// Returns a pointer that the kernel can use.
+// Returns 0 if the memory cannot be allocated.
+void *kalloc_noreclaim(void) { return allocpage(); }
+
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// Must not be called while holding a page cache or buffer cache lock.
 void *kalloc(void) {
+  void *pa = allocpage();
+  // out of memory: take back unused pages of cached files and blocks.
+  if (pa == 0 && (pcshrink(KMEM_BATCH) > 0 || bshrink(KMEM_BATCH) > 0))
+    pa = allocpage();
+  return pa;
+}
+
+// Add a reference to the page of physical memory pointed at by pa,
+// which must have been returned by kalloc().
+void kdup(void *pa) {
+  if (__sync_fetch_and_add(PA2REF(pa), 1) < 1) panic("kdup");
+}
+
+// Return the number of references to the page pointed at by pa.
+int krefcnt(void *pa) { return *PA2REF(pa); }
+
+// Return the number of free pages.
+int kfreepages(void) {
   acquire(&kmem.lock);
-  struct run *r = kmem.freelist;
-  if (r) kmem.freelist = r->next;
+  int n = kmem.nfree;
   release(&kmem.lock);
-
-  if (r) memset((char *)r, 5, PAGE_SIZE);  // fill with junk
-  return (void *)r;
+  for (struct kmem_cpu *c = kmem.cpus; c < &kmem.cpus[CPU_MAX_NUM]; c++) {
+    acquire(&c->lock);
+    n += c->nfree;
+    release(&c->lock);
+  }
+  return n;
 }
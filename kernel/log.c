@@ -12,8 +12,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only sealed when there are no FS
+// system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -21,97 +21,272 @@
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
 // But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// sleeps until the open transaction has been sealed.
 //
-// The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+// The log is double-buffered. end_op() does not commit: a kernel
+// thread, the flusher, seals the open transaction once it is old
+// enough, large enough, or someone waits for it, snapshots the
+// contents of its blocks, and opens a new one. Then, while FS
+// system calls go on gathering updates in the new transaction,
+// the flusher writes the sealed one to the log, commits it and
+// installs it. fsync() waits for a transaction to be installed.
+//
+// Only metadata goes through the log. The data blocks of regular
+// files are ordered data: log_data() adds them to the transaction,
+// and the flusher writes them straight to their home locations
+// before it commits the transaction, so that committed metadata
+// never points at blocks whose data is not on disk yet.
+//
+// The log is a physical re-do log containing disk blocks. It is
+// circular: each transaction the flusher commits is appended to it
+// as a record, wrapping around to the start of the log when the
+// record would not fit before its end. A record is:
+//   header blocks, containing a magic number, the transaction's
+//     sequence number, a checksum, and block #s for block A, B, ...
 //   block A
 //   block B
-//   block C
 //   ...
-// Log appends are synchronous.
+// The checksum covers the header and the blocks, so a record is
+// valid only once all of it is on disk, and writing the record is
+// the commit. Nothing is ever erased.
+//
+// The first block of the log is its tail: it holds the sequence
+// number of the record that starts right after it. Recovery follows
+// the chain of records from there, each starting where the one
+// before ends and having the next sequence number, up to the first
+// position that does not hold such a valid record. It replays the
+// last record of the chain; those before it were installed before
+// it was committed. Before a record wraps around and overwrites
+// older ones, the flusher points the tail at it. Those older
+// records, the last committed one included, have all been installed
+// by then, so no record recovery may still need is ever overwritten.
+
+// seal a transaction at most this many ticks after its first update,
+#define FLUSH_TICKS 1
+// or as soon as it holds this many blocks.
+#define FLUSH_BLOCKS (log.size / 2)
+
+#define LOGMAGIC 0x4c4f4721
+#define TAILMAGIC 0x4c4f4754
 
-// Contents of the header block, used for both the on-disk header block
-// and to keep track in memory of logged block# before commit.
+// where in the log the first record goes, after the tail block.
+#define LOGFIRST 1
+
+// the largest log mkfs makes, tail and header blocks included.
+#define NLOGMAX (LOGMAX + 1 + LOGHEAD(LOGMAX))
+
+// Contents of a record's header blocks, used both for the on-disk
+// header and to keep track in memory of logged block# before commit.
 struct logheader {
+  uint magic;  // LOGMAGIC
+  uint seq;    // sequence number of the transaction
+  uint sum;    // CRC-32 of the header, with sum 0, and the blocks
+  int n;
+  int block[LOGHEAD(LOGMAX) * BSIZE / sizeof(int) - 4];
+};
+
+// Contents of the log's tail block.
+struct logtail {
+  uint magic;  // TAILMAGIC
+  uint seq;    // sequence number of the record at LOGFIRST
+};
+
+// The block numbers of a transaction's ordered data blocks.
+struct datalist {
   int n;
-  int block[LOGSIZE];
+  int block[LOGMAX];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int nlog;         // number of blocks in the log
+  int size;         // max number of blocks in a transaction
+  int head;         // where in the log the next record goes
   int outstanding;  // how many FS sys calls are executing.
-  int committing;   // in commit(), please wait.
+  int sealing;      // flusher is sealing the open transaction, please wait.
   int dev;
-  struct logheader lh;
+  uint seq;                 // sequence number of the open transaction
+  uint want;                // highest sequence number someone waits for
+  uint done;                // sequence number of the last installed one
+  uint opened;              // ticks when the open transaction began
+  struct logheader lh;      // the open transaction
+  struct logheader sealed;  // the transaction the flusher writes
+  struct datalist data;        // the open transaction's data blocks
+  struct datalist sealeddata;  // the sealed transaction's data blocks
 };
 struct log log;
 
+// the contents of the sealed transaction's blocks as of sealing,
+// its logged blocks first and then its data blocks; the cached
+// blocks may already hold newer, uncommitted updates.
+// the blocks are in pages allocated for the size of the log,
+// which recovery uses to read the whole log.
+static uchar *snapshot[NLOGMAX];
+// the cached blocks themselves, pinned until they are installed.
+static struct buf *pinned[LOGMAX];
+
+static uint crctab[256];
+
 static void recover_from_log(void);
-static void commit();
+static void flusher(void);
 
 void initlog(int dev, struct superblock *sb) {
-  if (sizeof(struct logheader) >= BSIZE) panic("initlog: too big logheader");
-
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.nlog = sb->nlog;
+  log.size = LOGTXMAX(log.nlog);
   log.dev = dev;
+  if (log.size < MAXOPBLOCKS * 3 || log.size > LOGMAX || log.nlog > NLOGMAX)
+    panic("initlog: bad log size");
+
+  for (int i = 0; i < log.nlog; i += PAGE_SIZE / BSIZE) {
+    uchar *pa = kalloc();
+    if (pa == 0) panic("initlog: snapshot");
+    for (int j = 0; j < PAGE_SIZE / BSIZE && i + j < log.nlog; j++)
+      snapshot[i + j] = pa + j * BSIZE;
+  }
+
+  for (uint i = 0; i < 256; i++) {
+    uint c = i;
+    for (int k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crctab[i] = c;
+  }
+
   recover_from_log();
+  if (kthread("logflush", flusher) < 0) panic("initlog: flusher");
 }
 
-// Copy committed blocks from log to their home location
-static void install_trans(int recovering) {
-  for (int tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start + tail + 1);  // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]);    // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);                            // write dst to disk
-    if (recovering == 0) bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+// Continue the CRC-32 c over the n bytes at p.
+static uint crc(uint c, void *p, int n) {
+  uchar *s = p;
+  c = ~c;
+  while (n-- > 0) c = crctab[(c ^ *s++) & 0xff] ^ (c >> 8);
+  return ~c;
+}
+
+// The checksum of a record with header h and blocks data[].
+static uint checksum(struct logheader *h, uchar **data) {
+  uint sum = h->sum;
+  h->sum = 0;
+  uint c = crc(0, h, (4 + h->n) * sizeof(int));
+  h->sum = sum;
+  for (int i = 0; i < h->n; i++) c = crc(c, data[i], BSIZE);
+  return c;
+}
+
+// Read or write n blocks from or to mem[] in batches of disk
+// requests: block i goes to or comes from home[i], or block pos+i
+// of the log if home is 0. The I/O bypasses the buffer cache,
+// so that no buffer locks are held; only recovery and the flusher
+// call this, one at a time.
+static void logio(uchar **mem, int *home, int pos, int n, int write) {
+  static struct buf io[32];
+  static struct buf *iov[NELEM(io)];
+
+  for (int i = 0; i < n; i += NELEM(io)) {
+    int k = n - i < NELEM(io) ? n - i : NELEM(io);
+    for (int j = 0; j < k; j++) {
+      io[j].dev = log.dev;
+      io[j].blockno = home ? home[i + j] : log.start + pos + i + j;
+      io[j].data = mem[i + j];
+      iov[j] = &io[j];
+    }
+    iorwv(iov, k, write, true);
   }
 }
 
-// Read the log header from disk into the in-memory log header
-static void read_head(void) {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *)(buf->data);
-  log.lh.n = lh->n;
-  for (int i = 0; i < log.lh.n; i++) log.lh.block[i] = lh->block[i];
-  brelse(buf);
+// Copy the header of the record at log block pos, which recovery
+// has read into snapshot[pos...], into h.
+// Returns 1 if a valid record is there, 0 if not.
+static int read_record(int pos, struct logheader *h) {
+  struct logheader *first = (struct logheader *)snapshot[pos];
+  if (first->magic != LOGMAGIC || first->n < 0 || first->n > log.size ||
+      pos + LOGHEAD(first->n) + first->n > log.nlog)
+    return 0;
+
+  int nh = LOGHEAD(first->n);
+  for (int j = 0; j < nh; j++)
+    memmove((uchar *)h + j * BSIZE, snapshot[pos + j], BSIZE);
+  return h->sum == checksum(h, &snapshot[pos + nh]);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
-static void write_head(void) {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *)(buf->data);
-  hb->n = log.lh.n;
-  for (int i = 0; i < log.lh.n; i++) hb->block[i] = log.lh.block[i];
-  bwrite(buf);
-  brelse(buf);
+// Make the record with sequence number seq, about to be written at
+// LOGFIRST, the oldest one recovery considers. Every record before
+// it has been installed, so it may overwrite them.
+static void write_tail(uint seq) {
+  static uchar block[BSIZE];
+  struct logtail *t = (struct logtail *)block;
+  uchar *mem = block;
+
+  t->magic = TAILMAGIC;
+  t->seq = seq;
+  logio(&mem, 0, 0, 1, 1);
+}
+
+// Write the sealed transaction to the log at log.head as a record
+// with sequence number seq. This is the true point at which the
+// transaction commits.
+static void write_record(uint seq) {
+  struct logheader *h = &log.sealed;
+  int nh = LOGHEAD(h->n);
+  uchar *mem[LOGHEAD(LOGMAX)];
+
+  if (log.head + nh + h->n > log.nlog) log.head = LOGFIRST;  // never wrap
+  if (log.head == LOGFIRST) write_tail(seq);
+  h->magic = LOGMAGIC;
+  h->seq = seq;
+  h->sum = checksum(h, snapshot);
+
+  for (int j = 0; j < nh; j++) mem[j] = (uchar *)h + j * BSIZE;
+  logio(mem, 0, log.head, nh, 1);
+  logio(snapshot, 0, log.head + nh, h->n, 1);
+  log.head += nh + h->n;
 }
 
 static void recover_from_log(void) {
-  read_head();
-  install_trans(1);  // if committed, copy from log to disk
+  struct logtail *t = (struct logtail *)snapshot[0];
+  int last = -1;
+
+  logio(snapshot, 0, 0, log.nlog, 0);  // read the whole log
+  log.head = LOGFIRST;
+  log.seq = t->magic == TAILMAGIC ? t->seq : 1;
+  while (log.head < log.nlog && read_record(log.head, &log.sealed) &&
+         log.sealed.seq == log.seq) {
+    last = log.head;
+    log.lh = log.sealed;
+    log.head += LOGHEAD(log.lh.n) + log.lh.n;
+    log.seq++;
+  }
+
+  if (last >= 0) {
+    // it may not have been installed completely; copy it from
+    // the log to disk.
+    int nh = LOGHEAD(log.lh.n);
+    logio(&snapshot[last + nh], log.lh.block, 0, log.lh.n, 1);
+  }
+  log.done = log.seq - 1;
   log.lh.n = 0;
-  write_head();  // clear the log
 }
 
+// The number of blocks, logged and data, in the open transaction.
+// Each counts against the log's size, since both are snapshotted.
+// Caller must hold log.lock.
+static int nblocks(void) { return log.lh.n + log.data.n; }
+
 // called at the start of each FS system call.
 void begin_op(void) {
   acquire(&log.lock);
   while (true) {
-    if (log.committing) {
+    if (log.sealing) {
       sleep(&log, &log.lock);
-    } else if (log.lh.n + (log.outstanding + 1) * MAXOPBLOCKS > LOGSIZE) {
-      // this op might exhaust log space; wait for commit.
+    } else if (nblocks() + (log.outstanding + 1) * MAXOPBLOCKS > log.size) {
+      // this op might exhaust log space; have the open
+      // transaction sealed and wait for a new one.
+      if (nblocks() > 0 && log.want < log.seq) {
+        log.want = log.seq;
+        wakeup(&ticks);  // the flusher
+      }
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -122,16 +297,12 @@ void begin_op(void) {
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
 void end_op(void) {
-  bool do_commit = false;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if (log.committing) panic("log.committing");
-  if (log.outstanding == 0) {
-    do_commit = true;
-    log.committing = 1;
+  if (log.outstanding == 0 && log.sealing) {
+    // the flusher is waiting for the transaction to go quiet.
+    wakeup(&ticks);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -139,41 +310,108 @@ void end_op(void) {
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if (!do_commit) return;
-  // call commit w/o holding locks, since not allowed
-  // to sleep with locks.
-  commit();
+// Wait until the updates of every FS system call that has
+// ended so far are installed on disk.
+void log_sync(void) {
   acquire(&log.lock);
-  log.committing = 0;
-  wakeup(&log);
+  uint seq = nblocks() > 0 ? log.seq : log.seq - 1;
+  if (log.want < seq) {
+    log.want = seq;
+    wakeup(&ticks);  // the flusher
+  }
+  while (log.done < seq) sleep(&log, &log.lock);
   release(&log.lock);
 }
 
-// Copy modified blocks from cache to log.
-static void write_log(void) {
-  for (int tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start + tail + 1);  // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]);  // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+// Should the flusher seal the open transaction?
+// Caller must hold log.lock.
+static bool due(void) {
+  if (nblocks() == 0) return false;
+  return log.want >= log.seq || nblocks() >= FLUSH_BLOCKS ||
+         ticks - log.opened >= FLUSH_TICKS;
+}
+
+// Write the sealed transaction's blocks to their home locations.
+// The cached blocks may hold newer updates of the open transaction,
+// so the snapshot is written instead of them.
+static void install_sealed(void) {
+  logio(snapshot, log.sealed.block, 0, log.sealed.n, 1);
+  for (int tail = 0; tail < log.sealed.n; tail++) bunpin(pinned[tail]);
+}
+
+// Write the sealed transaction's data blocks to their home
+// locations, which must happen before the transaction commits.
+static void write_data(void) {
+  int n = log.sealed.n;
+
+  logio(&snapshot[n], log.sealeddata.block, 0, log.sealeddata.n, 1);
+  for (int i = 0; i < log.sealeddata.n; i++) bunpin(pinned[n + i]);
+}
+
+// The flusher: seal the open transaction when it is due, then
+// commit it while a new one gathers updates. It sleeps on &ticks,
+// so that it checks the age of the open transaction every tick;
+// others wake it early the same way.
+static void flusher(void) {
+  for (;;) {
+    acquire(&log.lock);
+    while (!due()) sleep(&ticks, &log.lock);
+
+    // stop new FS system calls and wait for the active ones.
+    log.sealing = 1;
+    while (log.outstanding > 0) sleep(&ticks, &log.lock);
+    log.sealed.n = log.lh.n;
+    memmove(log.sealed.block, log.lh.block, log.lh.n * sizeof(int));
+    log.sealeddata.n = log.data.n;
+    memmove(log.sealeddata.block, log.data.block, log.data.n * sizeof(int));
+    bsealed();  // its freed blocks may go to the next transaction
+    uint seq = log.seq;
+    release(&log.lock);
+
+    for (int i = 0; i < log.sealed.n + log.sealeddata.n; i++) {
+      int n = log.sealed.n;
+      int blockno = i < n ? log.sealed.block[i] : log.sealeddata.block[i - n];
+      struct buf *b = bread(log.dev, blockno);
+      memmove(snapshot[i], b->data, BSIZE);
+      pinned[i] = b;
+      brelse(b);
+    }
+
+    // open the next transaction.
+    acquire(&log.lock);
+    log.lh.n = 0;
+    log.data.n = 0;
+    log.seq++;
+    log.sealing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    write_data();       // Write data blocks to their home locations
+    write_record(seq);  // Write the record to the log -- the real commit
+    install_sealed();   // Now install writes to home locations
+
+    acquire(&log.lock);
+    log.done = seq;
+    wakeup(&log);
+    release(&log.lock);
   }
 }
 
-static void commit() {
-  if (log.lh.n <= 0) return;
-  write_log();       // Write modified blocks from cache to log
-  write_head();      // Write header to disk -- the real commit
-  install_trans(0);  // Now install writes to home locations
-  log.lh.n = 0;
-  write_head();  // Erase the transaction from the log
+// Return the index of blockno among the n blocks of block[],
+// or n if it is not among them.
+static int lookup(int *block, int n, uint blockno) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (block[i] == blockno) break;
+  }
+  return i;
 }
 
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The flusher will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -181,20 +419,41 @@ static void commit() {
 //   log_write(bp)
 //   brelse(bp)
 void log_write(struct buf *b) {
-  int i;
-
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
-    panic("too big a transaction");
   if (log.outstanding < 1) panic("log_write outside of trans");
 
-  for (i = 0; i < log.lh.n; i++) {
-    if (log.lh.block[i] == b->blockno) break;  // log absorbtion
-  }
-  log.lh.block[i] = b->blockno;
+  int i = lookup(log.lh.block, log.lh.n, b->blockno);
   if (i == log.lh.n) {  // Add new block to log?
+    int d = lookup(log.data.block, log.data.n, b->blockno);
+    if (d < log.data.n) {
+      // a freed data block that has become metadata: it must not
+      // reach its home before the transaction commits. it keeps
+      // the data list's pin.
+      log.data.block[d] = log.data.block[--log.data.n];
+    } else {
+      if (nblocks() >= log.size) panic("too big a transaction");
+      // pinned once for each transaction that holds it.
+      bpin(b);
+      if (nblocks() == 0) log.opened = ticks;
+    }
+    log.lh.block[log.lh.n++] = b->blockno;
+  }
+  release(&log.lock);
+}
+
+// Like log_write(), but for a block of file data, which is written
+// to its home location, not the log, before the transaction
+// commits. A block the transaction logs as metadata stays logged.
+void log_data(struct buf *b) {
+  acquire(&log.lock);
+  if (log.outstanding < 1) panic("log_data outside of trans");
+
+  if (lookup(log.lh.block, log.lh.n, b->blockno) == log.lh.n &&
+      lookup(log.data.block, log.data.n, b->blockno) == log.data.n) {
+    if (nblocks() >= log.size) panic("too big a transaction");
     bpin(b);
-    log.lh.n++;
+    if (nblocks() == 0) log.opened = ticks;
+    log.data.block[log.data.n++] = b->blockno;
   }
   release(&log.lock);
 }
@@ -43,8 +43,11 @@ void init(void) {
   plicinit();                       // set up interrupt controller
   plicinithart();                   // ask PLIC for device interrupts
   binit();                          // buffer cache
+  pcinit();                         // page cache
+  dcinit();                         // name cache
   iinit();                          // inode cache
   fileinit();                       // file table
+  ioinit();                         // disk request queue
   virtio_disk_init();               // emulated hard disk
   userinit();                       // first user process
 }
@@ -4,15 +4,21 @@
 #define NPROC 64                   // maximum number of processes
 #define CPU_MAX_NUM 8              // maximum number of CPUs
 #define NOFILE 16                  // open files per process
+#define NVMA 16                    // memory areas per process
 #define NFILE 100                  // open files per system
 #define NINODE 50                  // maximum number of active i-nodes
 #define NDEV 10                    // maximum major device number
 #define ROOTDEV 1                  // device number of file system root disk
 #define MAXARG 32                  // max exec arguments
-#define MAXOPBLOCKS 10             // max # of blocks any FS op writes
-#define LOGSIZE (MAXOPBLOCKS * 3)  // max data blocks in on-disk log
-#define NBUF (MAXOPBLOCKS * 3)     // size of disk block cache
-#define FSSIZE 1000                // size of file system in blocks
+#define MAXOPBLOCKS 32             // max # of blocks any FS op writes
+#define LOGSIZE 2048               // default size of on-disk log (blocks)
+#define LOGMAX 8192                // max data blocks in on-disk log
+#define NBUF_MIN (MAXOPBLOCKS * 3) // minimum size of disk block cache
+#define NBUF_MAX 8192              // maximum size of disk block cache
+#define FSSIZE 20000               // size of file system in blocks
+#define BPREALLOC 16               // free blocks kept for a file's appends
+#define NREADAHEAD 16              // blocks read ahead of a sequential reader
+#define IOMAXSEG 16                // max blocks in one disk request
 #define MAXPATH 128                // maximum file path name
 
 #endif
@@ -0,0 +1,163 @@
+// Page cache.
+//
+// The page cache holds whole pages of file data, keyed by
+// (dev, inum, page number), so that readi() can copy file data
+// a page at a time and mmap() can map the cached page itself
+// into a process's page table instead of a copy of it.
+//
+// Cached pages are ordinary kalloc() pages. The cache owns one
+// reference to each; pcget() gives the caller another, and the
+// caller drops it with kfree(), or by unmapping the page. A page
+// that only the cache refers to may be evicted at any time, by
+// the CLOCK algorithm when the cache is full or by kalloc() when
+// memory runs out. Pages that are still mapped are never evicted.
+//
+// The cache does not read files itself: ipage() in fs.c fills a
+// page through the buffer cache and adds it with pcput(), and
+// writei() keeps cached pages up to date with pcwrite(). Both are
+// called with the inode locked, which serializes all the page
+// cache operations on one file.
+
+#include "defs.h"
+#include "param.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "types.h"
+
+#define NPCPAGE 2048  // maximum number of cached pages
+#define NPCBUCKET 509
+
+struct page {
+  uint dev;
+  uint inum;
+  uint pgno;          // page number within the file
+  char *pa;           // the data; 0 if the entry is free
+  int used;           // referenced since the CLOCK hand last passed
+  struct page *next;  // hash chain, or free list
+};
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCPAGE];
+  struct page *bucket[NPCBUCKET];
+  struct page *free;  // free entries, linked through next
+  int hand;           // CLOCK hand, an index into page[]
+} pcache;
+
+static struct page **hash(uint dev, uint inum, uint pgno) {
+  return &pcache.bucket[(dev * 31 + inum * 17 + pgno) % NPCBUCKET];
+}
+
+void pcinit(void) {
+  initlock(&pcache.lock, "pcache");
+  for (struct page *pg = pcache.page; pg < &pcache.page[NPCPAGE]; pg++) {
+    pg->next = pcache.free;
+    pcache.free = pg;
+  }
+}
+
+// Find the cached page. Caller must hold pcache.lock.
+static struct page *lookup(uint dev, uint inum, uint pgno) {
+  for (struct page *pg = *hash(dev, inum, pgno); pg != 0; pg = pg->next) {
+    if (pg->dev == dev && pg->inum == inum && pg->pgno == pgno) return pg;
+  }
+  return 0;
+}
+
+// Remove pg from the cache and drop the cache's reference to
+// its page. Caller must hold pcache.lock.
+static void evict(struct page *pg) {
+  struct page **pp = hash(pg->dev, pg->inum, pg->pgno);
+  while (*pp != pg) pp = &(*pp)->next;
+  *pp = pg->next;
+  kfree(pg->pa);
+  pg->pa = 0;
+  pg->next = pcache.free;
+  pcache.free = pg;
+}
+
+// Return the cached page pgno of file (dev, inum), with a
+// reference for the caller, or 0 if it is not cached.
+char *pcget(uint dev, uint inum, uint pgno) {
+  acquire(&pcache.lock);
+  struct page *pg = lookup(dev, inum, pgno);
+  if (pg) {
+    pg->used = 1;
+    kdup(pg->pa);
+  }
+  release(&pcache.lock);
+  return pg ? pg->pa : 0;
+}
+
+// Add page pa, which holds page pgno of file (dev, inum), to
+// the cache. The cache takes its own reference to pa. If every
+// cached page is in use, pa is simply not cached.
+void pcput(uint dev, uint inum, uint pgno, char *pa) {
+  acquire(&pcache.lock);
+  // two sweeps: the first may only clear used bits.
+  for (int n = 0; pcache.free == 0 && n < 2 * NPCPAGE; n++) {
+    struct page *pg = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCPAGE;
+    if (krefcnt(pg->pa) > 1) continue;  // mapped or being read
+    if (pg->used) {
+      pg->used = 0;
+      continue;
+    }
+    evict(pg);
+  }
+
+  struct page *pg = pcache.free;
+  if (pg) {
+    pcache.free = pg->next;
+    pg->dev = dev;
+    pg->inum = inum;
+    pg->pgno = pgno;
+    pg->pa = pa;
+    pg->used = 1;
+    kdup(pa);
+    struct page **bk = hash(dev, inum, pgno);
+    pg->next = *bk;
+    *bk = pg;
+  }
+  release(&pcache.lock);
+}
+
+// Copy n bytes written at offset off of file (dev, inum) into
+// its cached page, if there is one. The bytes must lie in
+// a single page.
+void pcwrite(uint dev, uint inum, uint off, char *src, uint n) {
+  acquire(&pcache.lock);
+  struct page *pg = lookup(dev, inum, off / PAGE_SIZE);
+  if (pg) memmove(pg->pa + off % PAGE_SIZE, src, n);
+  release(&pcache.lock);
+}
+
+// Drop every cached page of file (dev, inum), whose contents
+// are being discarded. Pages that are still mapped stay with
+// their mappings.
+void pcdrop(uint dev, uint inum) {
+  acquire(&pcache.lock);
+  for (struct page *pg = pcache.page; pg < &pcache.page[NPCPAGE]; pg++) {
+    if (pg->pa && pg->dev == dev && pg->inum == inum) evict(pg);
+  }
+  release(&pcache.lock);
+}
+
+// Free up to n cached pages that nobody else refers to.
+// Called by kalloc() when it runs out of memory, so the caller
+// must not hold pcache.lock.
+// Returns the number of pages freed.
+int pcshrink(int n) {
+  int freed = 0;
+
+  acquire(&pcache.lock);
+  for (int i = 0; i < NPCPAGE && freed < n; i++) {
+    struct page *pg = &pcache.page[pcache.hand];
+    pcache.hand = (pcache.hand + 1) % NPCPAGE;
+    if (pg->pa == 0 || krefcnt(pg->pa) > 1) continue;
+    evict(pg);
+    freed++;
+  }
+  release(&pcache.lock);
+  return freed;
+}
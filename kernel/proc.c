@@ -11,6 +11,26 @@
 
 struct cpu cpus[CPU_MAX_NUM];
 
+// Multilevel feedback queue scheduling: a process starts at
+// priority 0 and moves down a level each time it uses up its
+// time slice, which doubles at each level. Every MLFQ_BOOST
+// ticks all processes move back to priority 0, so that
+// long-running processes are not starved.
+#define NPRIO 3
+#define MLFQ_SLICE(priority) (1 << (priority))
+#define MLFQ_BOOST 50
+
+// A per-CPU run queue of RUNNABLE processes, one FIFO list per
+// priority level. Other CPUs take its lock only to steal work.
+struct runq {
+  struct spinlock lock;
+  struct proc *head[NPRIO];
+  struct proc *tail[NPRIO];
+  uint epoch;  // boost period its processes' priorities belong to
+} __attribute__((aligned(64)));  // one cache line per CPU
+
+static struct runq runqs[CPU_MAX_NUM];
+
 struct proc proc[NPROC];
 
 struct proc *initproc;
@@ -20,6 +40,7 @@ struct spinlock pid_lock;
 
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void enqueue(struct proc *p);
 
 extern char trampoline[];  // trampoline.S
 
@@ -47,6 +68,8 @@ void proc_mapstacks(PageTable kpgtbl) {
 void procinit(void) {
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for (struct runq *rq = runqs; rq < &runqs[CPU_MAX_NUM]; rq++)
+    initlock(&rq->lock, "runq");
   for (struct proc *p = proc; p < &proc[NPROC]; p++) {
     initlock(&p->lock, "proc");
     p->kstack = KSTACK((int)(p - proc));
@@ -106,6 +129,9 @@ static struct proc *allocproc(void) {
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->priority = 0;
+  p->ticks = 0;
+  p->kthread = 0;
 
   // Allocate a trapframe page.
   if ((p->trapframe = (struct trapframe *)kalloc()) == 0) {
@@ -214,19 +240,48 @@ void userinit(void) {
   p->cwd = namei("/");
 
   p->state = RUNNABLE;
+  enqueue(p);
 
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void kthreadret(void) {
+  // Still holding p->lock from scheduler.
+  release(&myproc()->lock);
+
+  myproc()->kthread();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn(), which must never return.
+// The thread has no user memory and runs only in the kernel.
+// Returns its pid, or -1.
+int kthread(char *name, void (*fn)(void)) {
+  struct proc *p = allocproc();
+  if (p == 0) return -1;
+
+  p->kthread = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->state = RUNNABLE;
+  enqueue(p);
+  int pid = p->pid;
+  release(&p->lock);
+  return pid;
+}
+
 // Grow or shrink user memory by n bytes.
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
   struct proc *p = myproc();
-  uint sz = p->sz;
+  uint64 sz = p->sz;
   if (n > 0) {
-    if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
-      return -1;
-    }
+    // allocate lazily: usertrap() faults the pages in on first use.
+    if (sz + n > TRAPFRAME || vmaoverlap(p, sz, sz + n)) return -1;
+    sz += n;
   } else if (n < 0) {
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
@@ -247,12 +302,17 @@ int fork(void) {
   }
 
   // Copy user memory from parent to child.
-  if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0) {
+  if (uvmcopy(p->pagetable, np->pagetable, 0, p->sz) < 0) {
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if (vmadup(np, p) < 0) {
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -277,6 +337,7 @@ int fork(void) {
 
   acquire(&np->lock);
   np->state = RUNNABLE;
+  enqueue(np);
   release(&np->lock);
 
   return pid;
@@ -308,8 +369,10 @@ void exit(int status) {
     p->ofile[fd] = 0;
   }
 
+  vmasync(p->pagetable, p->vma);
   begin_op();
   iput(p->cwd);
+  vmaclear(p->pagetable, p->vma);
   end_op();
   p->cwd = 0;
 
@@ -340,6 +403,9 @@ int wait(uint64 addr) {
   int pid;
   struct proc *p = myproc();
 
+  // the copyout of the status happens under np->lock.
+  if (addr != 0) vmaprefault(p, addr, sizeof(int));
+
   acquire(&wait_lock);
 
   for (;;) {
@@ -379,37 +445,119 @@ int wait(uint64 addr) {
   }
 }
 
+// Put p, which has just become RUNNABLE, at the back of this
+// CPU's run queue for its priority. Caller must hold p->lock.
+static void enqueue(struct proc *p) {
+  // no boost can have been missed while p was not queued.
+  uint epoch = ticks / MLFQ_BOOST;
+  if (p->epoch != epoch) {
+    p->epoch = epoch;
+    p->priority = 0;
+    p->ticks = 0;
+  }
+
+  struct runq *rq = &runqs[cpuid()];
+  acquire(&rq->lock);
+  p->rqnext = 0;
+  if (rq->tail[p->priority])
+    rq->tail[p->priority]->rqnext = p;
+  else
+    rq->head[p->priority] = p;
+  rq->tail[p->priority] = p;
+  release(&rq->lock);
+}
+
+// Take the first process off rq's highest-priority non-empty list.
+// Returns 0 if rq is empty.
+static struct proc *dequeue(struct runq *rq) {
+  acquire(&rq->lock);
+  struct proc *p = 0;
+  for (int i = 0; i < NPRIO && p == 0; i++) {
+    if ((p = rq->head[i]) == 0) continue;
+    rq->head[i] = p->rqnext;
+    if (rq->head[i] == 0) rq->tail[i] = 0;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// Move every process in rq back to priority 0 if a boost
+// period has passed since the last time.
+static void boost(struct runq *rq) {
+  uint epoch = ticks / MLFQ_BOOST;
+  if (rq->epoch == epoch) return;
+
+  acquire(&rq->lock);
+  rq->epoch = epoch;
+  for (int i = 0; i < NPRIO; i++) {
+    for (struct proc *p = rq->head[i]; p; p = p->rqnext) {
+      p->priority = 0;
+      p->ticks = 0;
+      p->epoch = epoch;
+    }
+    if (i == 0 || rq->head[i] == 0) continue;
+    if (rq->tail[0])
+      rq->tail[0]->rqnext = rq->head[i];
+    else
+      rq->head[0] = rq->head[i];
+    rq->tail[0] = rq->tail[i];
+    rq->head[i] = rq->tail[i] = 0;
+  }
+  release(&rq->lock);
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the first one of the highest
+//    priority in this CPU's run queue, or failing that one
+//    stolen from another CPU's run queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
+// A CPU with nothing to run waits for an interrupt.
 void scheduler(void) {
   struct cpu *c = mycpu();
+  struct runq *rq = &runqs[cpuid()];
 
   c->proc = 0;
   for (;;) {
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for (struct proc *p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if (p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
+    boost(rq);
+    struct proc *p = dequeue(rq);
+    for (int i = 1; p == 0 && i < CPU_MAX_NUM; i++)
+      p = dequeue(&runqs[(cpuid() + i) % CPU_MAX_NUM]);
+
+    if (p == 0) {
+      // with interrupts off, an interrupt that makes a process
+      // RUNNABLE after the check still ends the wfi. wakeup()
+      // queues a process on the waker's CPU, so look at every
+      // run queue, or a process woken on a busy CPU would wait
+      // for the next timer interrupt to be stolen.
+      intr_off();
+      bool idle = true;
+      for (struct runq *q = runqs; q < &runqs[CPU_MAX_NUM]; q++) {
+        for (int i = 0; i < NPRIO; i++) idle &= q->head[i] == 0;
       }
-      release(&p->lock);
+      if (idle) asm volatile("wfi");
+      continue;
     }
+
+    acquire(&p->lock);
+    if (p->state != RUNNABLE) panic("scheduler: not runnable");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -439,10 +587,34 @@ void yield(void) {
   struct proc *p = myproc();
   acquire(&p->lock);
   p->state = RUNNABLE;
+  enqueue(p);
   sched();
   release(&p->lock);
 }
 
+// Called on each timer interrupt taken while the current process
+// runs. Once the process has used up its time slice it moves down
+// a priority level and yields; it also yields early to a process
+// of higher priority that is waiting for this CPU.
+void preempt(void) {
+  struct proc *p = myproc();
+
+  if (++p->ticks >= MLFQ_SLICE(p->priority)) {
+    p->ticks = 0;
+    if (p->priority < NPRIO - 1) p->priority++;
+    yield();
+    return;
+  }
+
+  push_off();
+  struct runq *rq = &runqs[cpuid()];
+  bool waiting = false;
+  // an unlocked peek: a stale answer costs at most one tick.
+  for (int i = 0; i < p->priority; i++) waiting |= rq->head[i] != 0;
+  pop_off();
+  if (waiting) yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void forkret(void) {
@@ -499,6 +671,7 @@ void wakeup(void *chan) {
     acquire(&p->lock);
     if (p->state == SLEEPING && p->chan == chan) {
       p->state = RUNNABLE;
+      enqueue(p);
     }
     release(&p->lock);
   }
@@ -515,6 +688,7 @@ int kill(int pid) {
       if (p->state == SLEEPING) {
         // Wake process from sleep().
         p->state = RUNNABLE;
+        enqueue(p);
       }
       release(&p->lock);
       return 0;
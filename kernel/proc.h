@@ -85,6 +85,20 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A range of user memory whose pages are read from a file
+// on first access. See vma.c.
+struct vma {
+  uint64 start;      // first address, page-aligned
+  uint64 end;        // end address, page-aligned
+  struct inode *ip;  // file holding the contents; 0 if slot unused
+  uint off;          // offset in the file of the byte at start
+  uint filesz;       // bytes that come from the file; the rest are zero
+  int perm;          // PTE permission bits of the pages
+  int flags;         // MAP_SHARED or MAP_PRIVATE
+  uint raoff;        // file offset after the last page faulted in
+  uint raend;        // file offset readahead has got to
+};
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -101,6 +115,13 @@ struct proc {
   // proc_tree_lock must be held when using this:
   struct proc *parent;  // Parent process
 
+  // scheduling state, see scheduler(). its run queue's lock must be
+  // held while the process is queued, p->lock otherwise.
+  int priority;         // MLFQ level; 0 is the highest
+  int ticks;            // timer ticks used at this level
+  uint epoch;           // boost period that priority belongs to
+  struct proc *rqnext;  // next process in the run queue
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;                // Virtual address of kernel stack
   uint64 sz;                    // Size of process memory (bytes)
@@ -109,5 +130,7 @@ struct proc {
   struct context context;       // swtch() here to run process
   struct file *ofile[NOFILE];   // Open files
   struct inode *cwd;            // Current directory
+  struct vma vma[NVMA];         // File-backed memory areas
+  void (*kthread)(void);        // function of a kernel thread, or 0
   char name[16];                // Process name (debugging)
 };
@@ -151,11 +151,17 @@ static inline void sfence_vma() {
 #define PAGE_ROUND_UP(size) (((size) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
 #define PAGE_ROUND_DOWN(address) (((address)) & ~(PAGE_SIZE - 1))
 
+// a leaf PTE in a level-1 page table maps a 2MB megapage.
+#define MEGAPAGE_SIZE (1L << PAGE_TABLE_INDEX_SHIFT(1))
+
 #define PAGE_TABLE_ENTRY_FLAGS_VALID (1L << 0)  // valid
 #define PAGE_TABLE_ENTRY_FLAGS_READABLE (1L << 1)
 #define PAGE_TABLE_ENTRY_FLAGS_WRITABLE (1L << 2)
 #define PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE (1L << 3)
-#define PAGE_TABLE_ENTRY_FLAGS_USER (1L << 4)  // 1 -> user can access
+#define PAGE_TABLE_ENTRY_FLAGS_USER (1L << 4)    // 1 -> user can access
+#define PAGE_TABLE_ENTRY_FLAGS_DIRTY (1L << 7)   // written since last cleared
+#define PAGE_TABLE_ENTRY_FLAGS_COW (1L << 8)     // RSW: copy-on-write page
+#define PAGE_TABLE_ENTRY_FLAGS_SHARED (1L << 9)  // RSW: MAP_SHARED page
 
 // shift a physical address to the right place for a PTE.
 #define PHYSICAL_ADDRESS_TO_PAGE_TABLE_ENTRY(physical_address) \
@@ -165,6 +171,13 @@ static inline void sfence_vma() {
 
 #define PAGE_TABLE_ENTRY_FLAGS(page_table_entry) ((page_table_entry)&0x3FF)
 
+// a valid PTE with any of R, W or X set is a leaf;
+// otherwise it points to the next level's page table.
+#define PAGE_TABLE_ENTRY_IS_LEAF(page_table_entry)                      \
+  (((page_table_entry) &                                                \
+    (PAGE_TABLE_ENTRY_FLAGS_READABLE | PAGE_TABLE_ENTRY_FLAGS_WRITABLE | \
+     PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE)) != 0)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PAGE_TABLE_INDEX_MASK 0x1FF  // 9 bits
 #define PAGE_TABLE_INDEX_SHIFT(level) (PAGE_SHIFT + (9 * (level)))
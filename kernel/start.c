@@ -36,6 +36,9 @@ void start() {
   write_mideleg(0xffff);
   write_sie(read_sie() | SIE_SEIE | SIE_STIE | SIE_SSIE);
 
+  // let supervisor mode read the time CSR, for read_time().
+  write_mcounteren(read_mcounteren() | 2);
+
   // ask for clock interrupts.
   init_timer();
 
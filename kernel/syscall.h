@@ -20,3 +20,7 @@
 #define SYS_link 19
 #define SYS_mkdir 20
 #define SYS_close 21
+#define SYS_mmap 22
+#define SYS_munmap 23
+#define SYS_fsync 24
+#define SYS_diskstat 25
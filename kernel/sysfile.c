@@ -5,6 +5,7 @@
 //
 
 #include "defs.h"
+#include "diskstat.h"
 #include "fcntl.h"
 #include "file.h"
 #include "fs.h"
@@ -59,6 +60,8 @@ uint64 sys_read(void) {
   uint64 p;
 
   if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0) return -1;
+  // the copy happens with the file locked.
+  if (n > 0) vmaprefault(myproc(), p, n);
   return fileread(f, p, n);
 }
 
@@ -68,6 +71,8 @@ uint64 sys_write(void) {
   uint64 p;
 
   if (argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0) return -1;
+  // the copy happens with the file locked.
+  if (n > 0) vmaprefault(myproc(), p, n);
 
   return filewrite(f, p, n);
 }
@@ -179,6 +184,7 @@ uint64 sys_unlink(void) {
   memset(&de, 0, sizeof(de));
   if (writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcinval(dp->dev, dp->inum, name);
   if (ip->type == T_DIR) {
     dp->nlink--;
     iupdate(dp);
@@ -225,18 +231,29 @@ static struct inode *create(char *path, short type, short major, short minor) {
   iupdate(ip);
 
   if (type == T_DIR) {  // Create . and .. entries.
-    dp->nlink++;        // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
-    if (dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
-      panic("create dots");
+    dirinit(ip, dp->inum);
   }
 
-  if (dirlink(dp, name, ip->inum) < 0) panic("create: dirlink");
+  // a hashed directory may have no room for name.
+  if (dirlink(dp, name, ip->inum) < 0) goto fail;
+
+  if (type == T_DIR) {
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // free the new inode.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 uint64 sys_open(void) {
@@ -288,6 +305,7 @@ uint64 sys_open(void) {
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->raoff = f->raend = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -411,3 +429,43 @@ uint64 sys_pipe(void) {
   }
   return 0;
 }
+
+uint64 sys_mmap(void) {
+  uint64 addr, len;
+  int prot, flags, off;
+  struct file *f;
+
+  if (argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 || argint(2, &prot) < 0 ||
+      argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argint(5, &off) < 0)
+    return -1;
+  // the kernel always chooses the address.
+  if (addr != 0 || off < 0) return -1;
+  return vmamap(myproc(), len, prot, flags, f, off);
+}
+
+uint64 sys_munmap(void) {
+  uint64 addr, len;
+
+  if (argaddr(0, &addr) < 0 || argaddr(1, &len) < 0) return -1;
+  return vmaunmap(myproc(), addr, len);
+}
+
+// Wait until the file system updates made so far, including
+// those to the file open at fd, are on disk.
+uint64 sys_fsync(void) {
+  struct file *f;
+
+  if (argfd(0, 0, &f) < 0) return -1;
+  log_sync();
+  return 0;
+}
+
+// Copy the disk statistics to the user struct diskstat at argument 0.
+uint64 sys_diskstat(void) {
+  uint64 addr;
+  struct diskstat st;
+
+  if (argaddr(0, &addr) < 0) return -1;
+  iostat(&st);
+  return copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st));
+}
@@ -25,7 +25,7 @@ uint64 sys_wait(void) {
 }
 
 uint64 sys_sbrk(void) {
-  int addr;
+  uint64 addr;
   int n;
 
   if (argint(0, &n) < 0) return -1;
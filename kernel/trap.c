@@ -54,6 +54,11 @@ void usertrap(void) {
     intr_on();
 
     syscall();
+  } else if ((read_scause() == 12 || read_scause() == 13 ||
+              read_scause() == 15) &&
+             uvmfault(p, read_stval(), read_scause() == 15) == 0) {
+    // page fault on a lazily-allocated or copy-on-write page,
+    // which is now mapped.
   } else if ((which_dev = devintr()) != 0) {
     // ok
   } else {
@@ -64,8 +69,8 @@ void usertrap(void) {
 
   if (p->killed) exit(-1);
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2) yield();
+  // maybe give up the CPU if this is a timer interrupt.
+  if (which_dev == 2) preempt();
 
   usertrapret();
 }
@@ -131,8 +136,9 @@ void kerneltrap() {
     panic("kerneltrap");
   }
 
-  // give up the CPU if this is a timer interrupt.
-  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING) yield();
+  // maybe give up the CPU if this is a timer interrupt.
+  if (which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
+    preempt();
 
   // the yield() may have caused some traps to occur,
   // so restore trap registers for use by kernelvec.S's sepc instruction.
@@ -29,6 +29,7 @@
 #define VIRTIO_MMIO_INTERRUPT_STATUS 0x060  // read-only
 #define VIRTIO_MMIO_INTERRUPT_ACK 0x064     // write-only
 #define VIRTIO_MMIO_STATUS 0x070            // read/write
+#define VIRTIO_MMIO_CONFIG 0x100            // device configuration space
 
 // status register bits, from qemu virtio_config.h
 #define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
@@ -46,8 +47,9 @@
 #define VIRTIO_RING_F_EVENT_IDX 29
 
 // this many virtio descriptors.
-// must be a power of two.
-#define NUM 8
+// must be a power of two, and small enough that the descriptors
+// and the avail ring fit in one page.
+#define NUM 128
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -56,8 +58,9 @@ struct virtq_desc {
   uint16 flags;
   uint16 next;
 };
-#define VRING_DESC_F_NEXT 1   // chained with another descriptor
-#define VRING_DESC_F_WRITE 2  // device writes (vs read)
+#define VRING_DESC_F_NEXT 1      // chained with another descriptor
+#define VRING_DESC_F_WRITE 2     // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4  // buffer holds a table of descriptors
 
 // the (entire) avail ring, from the spec.
 struct virtq_avail {
@@ -83,6 +86,10 @@ struct virtq_used {
 // these are specific to virtio block devices, e.g. disks,
 // described in Section 5.2 of the spec.
 
+// offset of the uint16 number of queues in the configuration
+// space, valid if VIRTIO_BLK_F_MQ was negotiated.
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
 #define VIRTIO_BLK_T_IN 0   // read the disk
 #define VIRTIO_BLK_T_OUT 1  // write the disk
 
@@ -4,7 +4,7 @@
 // qemu presents a "legacy" virtio interface.
 //
 // qemu ... -drive file=fs.img,if=none,format=raw,id=x0 -device
-// virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0
+// virtio-blk-device,drive=x0,bus=virtio-mmio-bus.0,num-queues=N
 //
 
 #include "buf.h"
@@ -20,8 +20,14 @@
 
 // the address of virtio mmio register r.
 #define R(r) ((volatile uint32 *)(VIRTIO0 + (r)))
-
-static struct disk {
+// the address of byte r of the device's configuration space.
+#define CONFIG(r) ((volatile uint8 *)(VIRTIO0 + VIRTIO_MMIO_CONFIG + (r)))
+
+// a virtqueue, through which the driver hands the device disk
+// operations. with VIRTIO_BLK_F_MQ the device has several, and
+// each hart submits to its own, so harts doing disk I/O at the
+// same time do not contend for one lock.
+struct queue {
   // the virtio driver and device mostly communicate through a set of
   // structures in RAM. pages[] allocates that memory. pages[] is a
   // global (instead of calls to kalloc()) because it must consist of
@@ -36,8 +42,9 @@ static struct disk {
   // the first region of pages[] is a set (not a ring) of DMA
   // descriptors, with which the driver tells the device where to read
   // and write individual disk operations. there are NUM descriptors.
-  // most commands consist of a "chain" (a linked list) of a couple of
-  // these descriptors.
+  // each disk operation uses one, which points to an indirect table
+  // holding the operation's "chain" (a linked list) of descriptors,
+  // so up to NUM operations can be in flight.
   // points into pages[].
   struct virtq_desc *desc;
 
@@ -60,25 +67,55 @@ static struct disk {
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
-  // indexed by first descriptor index of chain.
+  // indexed by the operation's descriptor.
   struct {
-    struct buf *b;
+    // each disk operation is a chain of descriptors, one for the
+    // header, one per buffer and one for the status, kept in this
+    // indirect table rather than in desc[].
+    struct virtq_desc ind[IOMAXSEG + 2] __attribute__((aligned(16)));
+    struct virtio_blk_req op;  // disk command header
+    struct buf *b;             // first buffer; the rest follow on qnext
+    int n;                     // number of buffers
     char status;
   } info[NUM];
 
-  // disk command headers.
-  // one-for-one with descriptors, for convenience.
-  struct virtio_blk_req ops[NUM];
+  struct spinlock lock;
+
+} __attribute__((aligned(PAGE_SIZE)));
+
+static struct disk {
+  struct queue q[CPU_MAX_NUM];
+  int nq;  // number of queues in use
+} disk;
+
+// set up virtqueue i, whose memory is vq.
+static void queue_init(int i, struct queue *vq) {
+  initlock(&vq->lock, "virtio_disk");
+
+  *R(VIRTIO_MMIO_QUEUE_SEL) = i;
+  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
+  if (max == 0) panic("virtio disk has no queue");
+  if (max < NUM) panic("virtio disk max queue too short");
+  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  memset(vq->pages, 0, sizeof(vq->pages));
+  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)vq->pages) >> PAGE_SHIFT;
+
+  // desc = pages -- num * virtq_desc
+  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
+  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
 
-  struct spinlock vdisk_lock;
+  vq->desc = (struct virtq_desc *)vq->pages;
+  vq->avail =
+      (struct virtq_avail *)(vq->pages + NUM * sizeof(struct virtq_desc));
+  vq->used = (struct virtq_used *)(vq->pages + PAGE_SIZE);
 
-} __attribute__((aligned(PAGE_SIZE))) disk;
+  // all NUM descriptors start out unused.
+  for (int j = 0; j < NUM; j++) vq->free[j] = 1;
+}
 
 void virtio_disk_init(void) {
   uint32 status = 0;
 
-  initlock(&disk.vdisk_lock, "virtio_disk");
-
   if (*R(VIRTIO_MMIO_MAGIC_VALUE) != 0x74726976 ||
       *R(VIRTIO_MMIO_VERSION) != 1 || *R(VIRTIO_MMIO_DEVICE_ID) != 2 ||
       *R(VIRTIO_MMIO_VENDOR_ID) != 0x554d4551) {
@@ -93,13 +130,13 @@ void virtio_disk_init(void) {
 
   // negotiate features
   uint64 features = *R(VIRTIO_MMIO_DEVICE_FEATURES);
+  if ((features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) == 0)
+    panic("virtio disk has no indirect descriptors");
   features &= ~(1 << VIRTIO_BLK_F_RO);
   features &= ~(1 << VIRTIO_BLK_F_SCSI);
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
-  features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
   features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
 
   // tell device that feature negotiation is complete.
@@ -112,175 +149,171 @@ void virtio_disk_init(void) {
 
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PAGE_SIZE;
 
-  // initialize queue 0.
-  *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
-  uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
-  if (max == 0) panic("virtio disk has no queue 0");
-  if (max < NUM) panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
-  *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PAGE_SHIFT;
-
-  // desc = pages -- num * virtq_desc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
-
-  disk.desc = (struct virtq_desc *)disk.pages;
-  disk.avail =
-      (struct virtq_avail *)(disk.pages + NUM * sizeof(struct virtq_desc));
-  disk.used = (struct virtq_used *)(disk.pages + PAGE_SIZE);
-
-  // all NUM descriptors start out unused.
-  for (int i = 0; i < NUM; i++) disk.free[i] = 1;
+  // one queue per hart, as far as the device has them.
+  disk.nq = 1;
+  if (features & (1 << VIRTIO_BLK_F_MQ)) {
+    disk.nq = CONFIG(VIRTIO_BLK_CONFIG_NUM_QUEUES)[0] |
+              CONFIG(VIRTIO_BLK_CONFIG_NUM_QUEUES)[1] << 8;
+    if (disk.nq > CPU_MAX_NUM) disk.nq = CPU_MAX_NUM;
+    if (disk.nq < 1) disk.nq = 1;
+  }
+  for (int i = 0; i < disk.nq; i++) queue_init(i, &disk.q[i]);
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
 
-// find a free descriptor, mark it non-free, return its index.
-static int alloc_desc() {
+// find a free descriptor of vq, mark it non-free, return its index.
+static int alloc_desc(struct queue *vq) {
   for (int i = 0; i < NUM; i++) {
-    if (disk.free[i]) {
-      disk.free[i] = 0;
+    if (vq->free[i]) {
+      vq->free[i] = 0;
       return i;
     }
   }
   return -1;
 }
 
-// mark a descriptor as free.
-static void free_desc(int i) {
+// mark a descriptor of vq as free.
+static void free_desc(struct queue *vq, int i) {
   if (i >= NUM) panic("free_desc 1");
-  if (disk.free[i]) panic("free_desc 2");
-  disk.desc[i].addr = 0;
-  disk.desc[i].len = 0;
-  disk.desc[i].flags = 0;
-  disk.desc[i].next = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  if (vq->free[i]) panic("free_desc 2");
+  vq->desc[i].addr = 0;
+  vq->desc[i].len = 0;
+  vq->desc[i].flags = 0;
+  vq->desc[i].next = 0;
+  vq->free[i] = 1;
 }
 
-// free a chain of descriptors.
-static void free_chain(int i) {
-  while (1) {
-    int flag = disk.desc[i].flags;
-    int nxt = disk.desc[i].next;
-    free_desc(i);
-    if (!(flag & VRING_DESC_F_NEXT)) break;
-    i = nxt;
+// Start reading or writing the n consecutive blocks of b and
+// the n-1 buffers after it on qnext as one disk operation, and
+// return without waiting. The operation goes to queue q, or to
+// another if the device has fewer queues. When it finishes,
+// virtio_disk_intr() calls iodone(b, n). Returns -1, starting
+// nothing, if the queue is full. Called by the I/O scheduler.
+int virtio_disk_submit(int q, struct buf *b, int n, int write) {
+  if (n < 1 || n > IOMAXSEG) panic("virtio_disk_submit");
+
+  q %= disk.nq;
+  struct queue *vq = &disk.q[q];
+  acquire(&vq->lock);
+  int i = alloc_desc(vq);
+  if (i < 0) {
+    release(&vq->lock);
+    return -1;
   }
-}
-
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
-static int alloc3_desc(int *idx) {
-  for (int i = 0; i < 3; i++) {
-    idx[i] = alloc_desc();
-    if (idx[i] < 0) {
-      for (int j = 0; j < i; j++) free_desc(idx[j]);
-      return -1;
-    }
-  }
-  return 0;
-}
-
-void virtio_disk_rw(struct buf *b, int write) {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while (1) {
-    if (alloc3_desc(idx) == 0) break;
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // one descriptor for type/reserved/sector, descriptors for the
+  // data, and one for a 1-byte status result. they go in an
+  // indirect table (Section 2.6.5.3), so an operation takes one
+  // slot of the ring however many buffers it covers.
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
-
-  buf0->type = write ? VIRTIO_BLK_T_OUT  // write the disk
-                     : VIRTIO_BLK_T_IN;  // read the disk
-  buf0->reserved = 0;
-  buf0->sector = sector;
-
-  disk.desc[idx[0]].addr = (uint64)buf0;
-  disk.desc[idx[0]].len = sizeof(struct virtio_blk_req);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
+  struct virtio_blk_req *op = &vq->info[i].op;
+  struct virtq_desc *ind = vq->info[i].ind;
+
+  op->type = write ? VIRTIO_BLK_T_OUT  // write the disk
+                   : VIRTIO_BLK_T_IN;  // read the disk
+  op->reserved = 0;
+  op->sector = b->blockno * (BSIZE / 512);
+
+  ind[0].addr = (uint64)op;
+  ind[0].len = sizeof(struct virtio_blk_req);
+  ind[0].flags = VRING_DESC_F_NEXT;
+  ind[0].next = 1;
+
+  struct buf *d = b;
+  for (int k = 1; k <= n; k++, d = d->qnext) {
+    ind[k].addr = (uint64)d->data;
+    ind[k].len = BSIZE;
+    ind[k].flags = write ? 0                    // device reads d->data
+                         : VRING_DESC_F_WRITE;  // device writes d->data
+    ind[k].flags |= VRING_DESC_F_NEXT;
+    ind[k].next = k + 1;
+  }
 
-  disk.desc[idx[1]].addr = (uint64)b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  disk.desc[idx[1]].flags = write
-                                ? 0                    // device reads b->data
-                                : VRING_DESC_F_WRITE;  // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  vq->info[i].status = 0xff;  // device writes 0 on success
+  ind[n + 1].addr = (uint64)&vq->info[i].status;
+  ind[n + 1].len = 1;
+  ind[n + 1].flags = VRING_DESC_F_WRITE;  // device writes the status
+  ind[n + 1].next = 0;
 
-  disk.info[idx[0]].status = 0xff;  // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64)&disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE;  // device writes the status
-  disk.desc[idx[2]].next = 0;
+  vq->desc[i].addr = (uint64)ind;
+  vq->desc[i].len = (n + 2) * sizeof(struct virtq_desc);
+  vq->desc[i].flags = VRING_DESC_F_INDIRECT;
+  vq->desc[i].next = 0;
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the buffers for virtio_disk_intr().
+  vq->info[i].b = b;
+  vq->info[i].n = n;
 
-  // tell the device the first index in our chain of descriptors.
-  disk.avail->ring[disk.avail->idx % NUM] = idx[0];
+  // tell the device the index of our descriptor.
+  vq->avail->ring[vq->avail->idx % NUM] = i;
 
   __sync_synchronize();
 
   // tell the device another avail ring entry is available.
-  disk.avail->idx += 1;  // not % NUM ...
+  vq->avail->idx += 1;  // not % NUM ...
 
   __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0;  // value is queue number
+  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = q;  // value is queue number
+
+  release(&vq->lock);
+  return 0;
+}
+
+// hand the operations vq's device has finished to iodone().
+static void queue_intr(struct queue *vq) {
+  acquire(&vq->lock);
+
+  // the device increments vq->used->idx when it
+  // adds an entry to the used ring.
+
+  while (vq->used_idx != vq->used->idx) {
+    __sync_synchronize();
+    int id = vq->used->ring[vq->used_idx % NUM].id;
+
+    if (vq->info[id].status != 0) panic("virtio_disk_intr status");
+
+    struct buf *b = vq->info[id].b;
+    int n = vq->info[id].n;
+    vq->info[id].b = 0;
+    free_desc(vq, id);
+    vq->used_idx += 1;
 
-  // Wait for virtio_disk_intr() to say request has finished.
-  while (b->disk == 1) sleep(b, &disk.vdisk_lock);
+    // iodone() may submit more operations.
+    release(&vq->lock);
+    iodone(b, n);
+    acquire(&vq->lock);
+  }
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+  release(&vq->lock);
+}
 
-  release(&disk.vdisk_lock);
+// handle the finished operations of queue q without waiting for
+// the interrupt, for iopoll().
+void virtio_disk_poll(int q) {
+  struct queue *vq = &disk.q[q % disk.nq];
+  // don't take the lock if there is nothing to do.
+  if (vq->used_idx != vq->used->idx) queue_intr(vq);
 }
 
+// the device has one interrupt for all its queues, which the
+// PLIC gives to whichever hart claims it first; that hart
+// completes the finished operations of every queue.
 void virtio_disk_intr() {
-  acquire(&disk.vdisk_lock);
-
   // the device won't raise another interrupt until we tell it
   // we've seen this interrupt, which the following line does.
   // this may race with the device writing new entries to
-  // the "used" ring, in which case we may process the new
+  // the "used" rings, in which case we may process the new
   // completion entries in this interrupt, and have nothing to do
   // in the next interrupt, which is harmless.
   *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
   __sync_synchronize();
 
-  // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
-
-  while (disk.used_idx != disk.used->idx) {
-    __sync_synchronize();
-    int id = disk.used->ring[disk.used_idx % NUM].id;
-
-    if (disk.info[id].status != 0) panic("virtio_disk_intr status");
-
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;  // disk is done with buf
-    wakeup(b);
-
-    disk.used_idx += 1;
-  }
-
-  release(&disk.vdisk_lock);
+  for (int i = 0; i < disk.nq; i++) queue_intr(&disk.q[i]);
 }
@@ -5,7 +5,9 @@
 #include "fs.h"
 #include "memlayout.h"
 #include "param.h"
+#include "proc.h"
 #include "riscv.h"
+#include "spinlock.h"
 #include "types.h"
 
 /*
@@ -17,6 +19,11 @@ extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[];  // trampoline.S
 
+// number of megapages in the kernel page table, and of the
+// level-0 page-table pages that mapping them saved.
+static int nmegapage;
+static int nptsaved;
+
 // Make a direct-map page table for the kernel.
 PageTable KernalVertualMemory_make(void) {
   PageTable kernel_page_table = (PageTable)kalloc();
@@ -82,6 +89,8 @@ PageTable KernalVertualMemory_make(void) {
 // Initialize the one kernel_pagetable
 void KernelVirtualMemory_init(void) {
   kernel_pagetable = KernalVertualMemory_make();
+  printf("kvm: %d megapages, %d page-table pages saved\n", nmegapage,
+         nptsaved);
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -91,25 +100,20 @@ void KernelVirtualMemory_init_hart() {
   sfence_vma();
 }
 
-// Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
-//
-// The risc-v Sv39 scheme has three levels of page-table
-// pages. A page-table page contains 512 64-bit PTEs.
-// A 64-bit virtual address is split into five fields:
-//   39..63 -- must be zero.
-//   30..38 -- 9 bits of level-2 index.
-//   21..29 -- 9 bits of level-1 index.
-//   12..20 -- 9 bits of level-0 index.
-//    0..11 -- 12 bits of byte offset within the page.
-PageTableEntry *walk(PageTable page_table, uint64 virtual_address, bool alloc) {
+// Return the address of the PTE in the target_level page table
+// of pagetable that corresponds to virtual address va, or of the
+// megapage PTE that maps va if there is one on the way.
+// If alloc!=0, create any required page-table pages.
+static PageTableEntry *walk_level(PageTable page_table,
+                                  uint64 virtual_address, int target_level,
+                                  bool alloc) {
   if (virtual_address >= MAX_VIRTUAL_ADDRESS) panic("walk");
 
-  for (int level = 2; level > 0; level--) {
+  for (int level = 2; level > target_level; level--) {
     PageTableEntry *page_table_entry =
         &page_table[PAGE_TABLE_INDEX(level, virtual_address)];
     if (*page_table_entry & PAGE_TABLE_ENTRY_FLAGS_VALID) {
+      if (PAGE_TABLE_ENTRY_IS_LEAF(*page_table_entry)) return page_table_entry;
       page_table =
           (PageTable)PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(*page_table_entry);
       continue;
@@ -121,7 +125,25 @@ PageTableEntry *walk(PageTable page_table, uint64 virtual_address, bool alloc) {
     *page_table_entry = PHYSICAL_ADDRESS_TO_PAGE_TABLE_ENTRY(page_table) |
                         PAGE_TABLE_ENTRY_FLAGS_VALID;
   }
-  return &page_table[PAGE_TABLE_INDEX(0, virtual_address)];
+  return &page_table[PAGE_TABLE_INDEX(target_level, virtual_address)];
+}
+
+// Return the address of the PTE in page table pagetable
+// that corresponds to virtual address va.  If alloc!=0,
+// create any required page-table pages.
+//
+// The risc-v Sv39 scheme has three levels of page-table
+// pages. A page-table page contains 512 64-bit PTEs.
+// A 64-bit virtual address is split into five fields:
+//   39..63 -- must be zero.
+//   30..38 -- 9 bits of level-2 index.
+//   21..29 -- 9 bits of level-1 index.
+//   12..20 -- 9 bits of level-0 index.
+//    0..11 -- 12 bits of byte offset within the page.
+// If va lies in a 2MB megapage, which only the kernel page
+// table uses, this returns the megapage's level-1 PTE.
+PageTableEntry *walk(PageTable page_table, uint64 virtual_address, bool alloc) {
+  return walk_level(page_table, virtual_address, 0, alloc);
 }
 
 // Look up a virtual address, return the physical address,
@@ -149,7 +171,9 @@ void KernelVirtualMemory_map(PageTable kpgtbl, uint64 virtual_address,
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Kernel mappings use a 2MB megapage wherever
+// va and pa are aligned for one and the range covers all of it.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 bool map_pages(PageTable page_table, uint64 virtual_address, uint64 size,
                uint64 physical_address, int permission) {
@@ -158,29 +182,46 @@ bool map_pages(PageTable page_table, uint64 virtual_address, uint64 size,
   uint64 pa = physical_address;
 
   for (;;) {
-    PageTableEntry *page_table_entry = walk(page_table, va, true /* alloc */);
-    if (page_table_entry == 0) return false;
-    if (*page_table_entry & PAGE_TABLE_ENTRY_FLAGS_VALID) panic("remap");
+    uint64 step = PAGE_SIZE;
+    PageTableEntry *page_table_entry = 0;
+    if ((permission & PAGE_TABLE_ENTRY_FLAGS_USER) == 0 &&
+        va % MEGAPAGE_SIZE == 0 && pa % MEGAPAGE_SIZE == 0 &&
+        va_last - va >= MEGAPAGE_SIZE - PAGE_SIZE) {
+      page_table_entry = walk_level(page_table, va, 1, true /* alloc */);
+      if (page_table_entry == 0) return false;
+      if (*page_table_entry & PAGE_TABLE_ENTRY_FLAGS_VALID) {
+        // part of the range is already mapped with small pages.
+        page_table_entry = 0;
+      } else {
+        step = MEGAPAGE_SIZE;
+        nmegapage++;
+        // walk() would have allocated a level-0 page here.
+        nptsaved++;
+      }
+    }
+    if (page_table_entry == 0) {
+      page_table_entry = walk(page_table, va, true /* alloc */);
+      if (page_table_entry == 0) return false;
+      if (*page_table_entry & PAGE_TABLE_ENTRY_FLAGS_VALID) panic("remap");
+    }
     *page_table_entry = PHYSICAL_ADDRESS_TO_PAGE_TABLE_ENTRY(pa) | permission |
                         PAGE_TABLE_ENTRY_FLAGS_VALID;
-    if (va == va_last) break;
-    va += PAGE_SIZE;
-    pa += PAGE_SIZE;
+    if (va_last - va < step) break;
+    va += step;
+    pa += step;
   }
   return true;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in are skipped.
 // Optionally free the physical memory.
 void uvmunmap(PageTable pagetable, uint64 va, uint64 npages, int do_free) {
   if ((va % PAGE_SIZE) != 0) panic("uvmunmap: not aligned");
 
   for (uint64 a = va; a < va + npages * PAGE_SIZE; a += PAGE_SIZE) {
     PageTableEntry *pte = walk(pagetable, a, false /* alloc */);
-    if (pte == 0) panic("uvmunmap: walk");
-    if ((*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0)
-      panic("uvmunmap: not mapped");
+    if (pte == 0 || (*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0) continue;
     if (PAGE_TABLE_ENTRY_FLAGS(*pte) == PAGE_TABLE_ENTRY_FLAGS_VALID)
       panic("uvmunmap: not a leaf");
     if (do_free) {
@@ -262,9 +303,7 @@ void freewalk(PageTable pagetable) {
   for (int i = 0; i < 512; i++) {
     PageTableEntry pte = pagetable[i];
     if ((pte & PAGE_TABLE_ENTRY_FLAGS_VALID) &&
-        (pte &
-         (PAGE_TABLE_ENTRY_FLAGS_READABLE | PAGE_TABLE_ENTRY_FLAGS_WRITABLE |
-          PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE)) == 0) {
+        !PAGE_TABLE_ENTRY_IS_LEAF(pte)) {
       // this PTE points to a lower-level page table.
       uint64 child = PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(pte);
       freewalk((PageTable)child);
@@ -283,39 +322,126 @@ void uvmfree(PageTable pagetable, uint64 sz) {
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, share its
+// memory in [start, end) with a child's page table.
+// Copies the page table but not the physical memory:
+// writable pages other than MAP_SHARED ones become
+// read-only copy-on-write pages in both page tables,
+// and are copied by uvmcow() on the first store.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
-int uvmcopy(PageTable old, PageTable new, uint64 sz) {
+int uvmcopy(PageTable old, PageTable new, uint64 start, uint64 end) {
   uint64 i;
 
-  for (i = 0; i < sz; i += PAGE_SIZE) {
+  for (i = start; i < end; i += PAGE_SIZE) {
     PageTableEntry *pte = walk(old, i, false /* alloc */);
-    uint64 pa;
-    uint flags;
-    char *mem;
-    if (pte == 0) panic("uvmcopy: pte should exist");
-    if ((*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0)
-      panic("uvmcopy: page not present");
-    pa = PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(*pte);
-    flags = PAGE_TABLE_ENTRY_FLAGS(*pte);
-    if ((mem = kalloc()) == 0) goto err;
-    memmove(mem, (char *)pa, PAGE_SIZE);
-    if (!map_pages(new, i, PAGE_SIZE, (uint64)mem, flags)) {
-      kfree(mem);
-      goto err;
+    // not yet faulted in; the child will fault it in itself.
+    if (pte == 0 || (*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0) continue;
+    if ((*pte & PAGE_TABLE_ENTRY_FLAGS_WRITABLE) &&
+        (*pte & PAGE_TABLE_ENTRY_FLAGS_SHARED) == 0) {
+      *pte &= ~PAGE_TABLE_ENTRY_FLAGS_WRITABLE;
+      *pte |= PAGE_TABLE_ENTRY_FLAGS_COW;
     }
+    uint64 pa = PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(*pte);
+    uint flags = PAGE_TABLE_ENTRY_FLAGS(*pte);
+    if (!map_pages(new, i, PAGE_SIZE, pa, flags)) goto err;
+    kdup((void *)pa);
   }
   return 0;
 
 err:
-  uvmunmap(new, 0, i / PAGE_SIZE, 1);
+  uvmunmap(new, start, (i - start) / PAGE_SIZE, 1);
   return -1;
 }
 
+// Give the page table its own writable copy of the
+// copy-on-write user page at va. If no other page
+// table shares the page, it is made writable in place.
+// returns 0 on success, -1 if va is not a copy-on-write
+// user page or memory is exhausted.
+int uvmcow(PageTable pagetable, uint64 va) {
+  if (va >= MAX_VIRTUAL_ADDRESS) return -1;
+  PageTableEntry *pte = walk(pagetable, va, false /* alloc */);
+  if (pte == 0) return -1;
+  if ((*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0 ||
+      (*pte & PAGE_TABLE_ENTRY_FLAGS_USER) == 0 ||
+      (*pte & PAGE_TABLE_ENTRY_FLAGS_COW) == 0)
+    return -1;
+
+  uint64 pa = PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(*pte);
+  uint flags = (PAGE_TABLE_ENTRY_FLAGS(*pte) & ~PAGE_TABLE_ENTRY_FLAGS_COW) |
+               PAGE_TABLE_ENTRY_FLAGS_WRITABLE;
+  if (krefcnt((void *)pa) == 1) {
+    // the other sharers are gone.
+    *pte = PHYSICAL_ADDRESS_TO_PAGE_TABLE_ENTRY(pa) | flags;
+    return 0;
+  }
+
+  char *mem = kalloc();
+  if (mem == 0) return -1;
+  memmove(mem, (char *)pa, PAGE_SIZE);
+  *pte = PHYSICAL_ADDRESS_TO_PAGE_TABLE_ENTRY(mem) | flags;
+  kfree((void *)pa);
+  return 0;
+}
+
+// Handle a page fault at user virtual address va of process p.
+// A store to a copy-on-write page gets a private copy, a page of
+// a VMA is read from its file, and a page below p->sz that sbrk()
+// reserved but nobody has touched yet is allocated and zeroed.
+// returns 0 if the access can be retried, -1 if it is invalid
+// or memory is exhausted.
+int uvmfault(struct proc *p, uint64 va, bool write) {
+  if (va >= MAX_VIRTUAL_ADDRESS) return -1;
+  va = PAGE_ROUND_DOWN(va);
+  PageTableEntry *pte = walk(p->pagetable, va, false /* alloc */);
+  if (pte && (*pte & PAGE_TABLE_ENTRY_FLAGS_VALID)) {
+    if (write && (*pte & PAGE_TABLE_ENTRY_FLAGS_COW))
+      return uvmcow(p->pagetable, va);
+    return -1;
+  }
+  struct vma *v = vmalookup(p, va);
+  if (v) return vmafill(p->pagetable, v, va);
+  if (va >= p->sz) return -1;
+
+  char *mem = kalloc();
+  if (mem == 0) return -1;
+  memset(mem, 0, PAGE_SIZE);
+  if (!map_pages(p->pagetable, va, PAGE_SIZE, (uint64)mem,
+                 PAGE_TABLE_ENTRY_FLAGS_WRITABLE |
+                     PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE |
+                     PAGE_TABLE_ENTRY_FLAGS_READABLE |
+                     PAGE_TABLE_ENTRY_FLAGS_USER)) {
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Look up user virtual address va for copyin() and friends,
+// returning its physical address or 0. Pages the current process
+// has not faulted in yet are faulted in here, and a page about to
+// be written gets its own copy if it is copy-on-write, and is
+// marked dirty so that a MAP_SHARED page is written back.
+static uint64 uvmaddr(PageTable pagetable, uint64 va, bool write) {
+  if (va >= MAX_VIRTUAL_ADDRESS) return 0;
+  PageTableEntry *pte = walk(pagetable, va, false /* alloc */);
+  if (pte == 0 || (*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0) {
+    struct proc *p = myproc();
+    if (p == 0 || p->pagetable != pagetable || uvmfault(p, va, write) < 0)
+      return 0;
+  } else if (write && (*pte & PAGE_TABLE_ENTRY_FLAGS_COW) &&
+             uvmcow(pagetable, va) < 0) {
+    return 0;
+  }
+  if (write) {
+    pte = walk(pagetable, va, false /* alloc */);
+    if ((*pte & PAGE_TABLE_ENTRY_FLAGS_WRITABLE) == 0) return 0;
+    *pte |= PAGE_TABLE_ENTRY_FLAGS_DIRTY;
+  }
+  return walkaddr(pagetable, va);
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void uvmclear(PageTable pagetable, uint64 va) {
@@ -331,7 +457,7 @@ int copyout(PageTable pagetable, uint64 dstva, char *src, uint64 len) {
   while (len > 0) {
     uint64 n;
     uint64 va0 = PAGE_ROUND_DOWN(dstva);
-    uint64 pa0 = walkaddr(pagetable, va0);
+    uint64 pa0 = uvmaddr(pagetable, va0, true /* write */);
     if (pa0 == 0) return -1;
     n = PAGE_SIZE - (dstva - va0);
     if (n > len) n = len;
@@ -351,7 +477,7 @@ int copyin(PageTable pagetable, char *dst, uint64 srcva, uint64 len) {
   while (len > 0) {
     uint64 n;
     uint64 va0 = PAGE_ROUND_DOWN(srcva);
-    uint64 pa0 = walkaddr(pagetable, va0);
+    uint64 pa0 = uvmaddr(pagetable, va0, false /* write */);
     if (pa0 == 0) return -1;
     n = PAGE_SIZE - (srcva - va0);
     if (n > len) n = len;
@@ -373,7 +499,7 @@ int copyinstr(PageTable pagetable, char *dst, uint64 srcva, uint64 max) {
   while (!got_null && max > 0) {
     uint64 n;
     uint64 va0 = PAGE_ROUND_DOWN(srcva);
-    uint64 pa0 = walkaddr(pagetable, va0);
+    uint64 pa0 = uvmaddr(pagetable, va0, false /* write */);
     if (pa0 == 0) return -1;
     n = PAGE_SIZE - (srcva - va0);
     if (n > max) n = max;
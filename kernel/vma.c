@@ -0,0 +1,315 @@
+//
+// Virtual memory areas: ranges of user memory whose contents
+// come from a file. exec() creates one for each program segment,
+// and mmap() creates them on request.
+//
+// Setting up a VMA reads nothing. The first access to each page
+// of the range faults, and uvmfault() calls vmafill() to map the
+// page. Where possible that is the file's page in the page cache
+// itself, so no data is copied; otherwise, as for the last page
+// of a program segment whose rest is bss, the page is a copy.
+//
+// Stores to a MAP_PRIVATE VMA stay in the process: a page cache
+// page is mapped copy-on-write. A MAP_SHARED VMA maps the page
+// cache pages writable, so every process mapping the file sees
+// the stores, and pages the process has dirtied are written back
+// to the file by munmap(), exec() and exit().
+//
+// A process's VMAs are private to it, like its open files, so
+// p->lock need not be held to use them.
+//
+
+#include "defs.h"
+#include "fcntl.h"
+#include "file.h"
+#include "fs.h"
+#include "memlayout.h"
+#include "param.h"
+#include "proc.h"
+#include "riscv.h"
+#include "sleeplock.h"
+#include "spinlock.h"
+#include "types.h"
+
+// Return the VMA of p that contains va, or 0.
+struct vma *vmalookup(struct proc *p, uint64 va) {
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip && v->start <= va && va < v->end) return v;
+  }
+  return 0;
+}
+
+// Return a VMA of p that overlaps [start, end), or 0.
+struct vma *vmaoverlap(struct proc *p, uint64 start, uint64 end) {
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip && v->start < end && start < v->end) return v;
+  }
+  return 0;
+}
+
+// Start reading the file ahead of a fault on the page at file
+// offset off, if it follows the page v faulted in last, as for a
+// program reading a mapped file from start to end.
+// Caller must hold v->ip->lock.
+static void readahead(struct vma *v, uint off) {
+  if (off == v->raoff) v->raend = ireadahead(v->ip, off, v->raend);
+  v->raoff = off + PAGE_SIZE;
+}
+
+// Map the page at va of v into pagetable, reading it from the file
+// if it is not in the page cache.
+// Returns 0 on success, -1 if memory is exhausted or the file
+// cannot be read.
+int vmafill(PageTable pagetable, struct vma *v, uint64 va) {
+  va = PAGE_ROUND_DOWN(va);
+  uint off = v->off + (va - v->start);
+  int perm = v->perm | PAGE_TABLE_ENTRY_FLAGS_USER;
+  char *mem;
+
+  if (off % PAGE_SIZE == 0 && va - v->start + PAGE_SIZE <= v->filesz) {
+    // the whole page is file data: map the cached page.
+    ilock(v->ip);
+    readahead(v, off);
+    mem = ipage(v->ip, off / PAGE_SIZE);
+    iunlock(v->ip);
+    if (mem == 0) return -1;
+    if (v->flags & MAP_SHARED) {
+      perm |= PAGE_TABLE_ENTRY_FLAGS_SHARED;
+    } else if (perm & PAGE_TABLE_ENTRY_FLAGS_WRITABLE) {
+      perm &= ~PAGE_TABLE_ENTRY_FLAGS_WRITABLE;
+      perm |= PAGE_TABLE_ENTRY_FLAGS_COW;
+    }
+    if (!map_pages(pagetable, va, PAGE_SIZE, (uint64)mem, perm)) goto bad;
+    return 0;
+  }
+
+  if ((mem = kalloc()) == 0) return -1;
+  memset(mem, 0, PAGE_SIZE);
+
+  uint n = 0;
+  if (va - v->start < v->filesz) {
+    n = v->filesz - (va - v->start);
+    if (n > PAGE_SIZE) n = PAGE_SIZE;
+  }
+  if (n > 0) {
+    // a read past the end of the file leaves zeros.
+    ilock(v->ip);
+    readahead(v, off);
+    int r = readi(v->ip, 0, (uint64)mem, off, n);
+    iunlock(v->ip);
+    if (r < 0) goto bad;
+  }
+
+  if (v->flags & MAP_SHARED) perm |= PAGE_TABLE_ENTRY_FLAGS_SHARED;
+  if (!map_pages(pagetable, va, PAGE_SIZE, (uint64)mem, perm)) goto bad;
+  return 0;
+
+bad:
+  kfree(mem);
+  return -1;
+}
+
+// Fault in the not yet present pages of p's VMAs that lie in
+// [va, va+len), so that copyin() and copyout() of the range
+// will not have to read a file. Called before copies that are
+// made while holding a lock, such as reads into a buffer in a
+// program's data segment.
+void vmaprefault(struct proc *p, uint64 va, uint64 len) {
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip == 0) continue;
+    uint64 a = va > v->start ? PAGE_ROUND_DOWN(va) : v->start;
+    uint64 last = va + len < v->end ? va + len : v->end;
+    for (; a < last; a += PAGE_SIZE) {
+      // failures show up as a failed copy later.
+      if (walkaddr(p->pagetable, a) == 0) vmafill(p->pagetable, v, a);
+    }
+  }
+}
+
+// Write the dirty pages of v in [start, end) back to its file,
+// as far as they came from the file and still lie within it.
+static void writeback(PageTable pagetable, struct vma *v, uint64 start,
+                      uint64 end) {
+  // stay within a log transaction, as filewrite() does.
+  int max = ((MAXOPBLOCKS - 1 - 1 - 2) / 2) * BSIZE;
+
+  for (uint64 va = start; va < end; va += PAGE_SIZE) {
+    PageTableEntry *pte = walk(pagetable, va, false /* alloc */);
+    if (pte == 0 || (*pte & PAGE_TABLE_ENTRY_FLAGS_VALID) == 0 ||
+        (*pte & PAGE_TABLE_ENTRY_FLAGS_DIRTY) == 0)
+      continue;
+    uint64 pa = PAGE_TABLE_ENTRY_TO_PHYSICAL_ADDRESS(*pte);
+    uint off = v->off + (va - v->start);
+
+    // only the part of the page that vmafill() took from the file;
+    // the rest was zero-filled and may now lie over data that
+    // write() appended after the mapping was made.
+    uint filesz = 0;
+    if (va - v->start < v->filesz) filesz = v->filesz - (va - v->start);
+    if (filesz > PAGE_SIZE) filesz = PAGE_SIZE;
+
+    for (uint i = 0; i < filesz;) {
+      begin_op();
+      ilock(v->ip);
+      int n = 0;
+      if (off + i < v->ip->size) {
+        n = v->ip->size - (off + i);
+        if (n > filesz - i) n = filesz - i;
+        if (n > max) n = max;
+        n = writei(v->ip, 0, pa + i, off + i, n);
+      }
+      iunlock(v->ip);
+      end_op();
+      if (n <= 0) break;
+      i += n;
+    }
+    *pte &= ~PAGE_TABLE_ENTRY_FLAGS_DIRTY;
+  }
+}
+
+// Write back the dirty pages of the MAP_SHARED VMAs among
+// the NVMA VMAs in vma, which are mapped in pagetable.
+void vmasync(PageTable pagetable, struct vma *vma) {
+  for (struct vma *v = vma; v < &vma[NVMA]; v++) {
+    if (v->ip && (v->flags & MAP_SHARED))
+      writeback(pagetable, v, v->start, v->end);
+  }
+}
+
+// Give np copies of p's VMAs, sharing the pages of those above
+// p->sz, which uvmcopy() did not cover. Returns 0 on success,
+// -1 if memory is exhausted, in which case np is left unchanged.
+int vmadup(struct proc *np, struct proc *p) {
+  int i;
+
+  for (i = 0; i < NVMA; i++) {
+    struct vma *v = &p->vma[i];
+    if (v->ip == 0 || v->start < p->sz) continue;
+    if (uvmcopy(p->pagetable, np->pagetable, v->start, v->end) < 0) goto bad;
+  }
+  for (i = 0; i < NVMA; i++) {
+    np->vma[i] = p->vma[i];
+    if (np->vma[i].ip) idup(np->vma[i].ip);
+  }
+  return 0;
+
+bad:
+  while (--i >= 0) {
+    struct vma *v = &p->vma[i];
+    if (v->ip == 0 || v->start < p->sz) continue;
+    uvmunmap(np->pagetable, v->start, (v->end - v->start) / PAGE_SIZE, 1);
+  }
+  return -1;
+}
+
+// Drop the NVMA VMAs in vma, unmapping their pages from
+// pagetable, if it is not 0, and releasing their files.
+// Must be called inside a transaction, since it calls iput().
+void vmaclear(PageTable pagetable, struct vma *vma) {
+  for (struct vma *v = vma; v < &vma[NVMA]; v++) {
+    if (v->ip == 0) continue;
+    if (pagetable)
+      uvmunmap(pagetable, v->start, (v->end - v->start) / PAGE_SIZE, 1);
+    iput(v->ip);
+    v->ip = 0;
+  }
+}
+
+// Map len bytes of file f, starting at offset off, into p's memory
+// as a new VMA. prot and flags are as for mmap().
+// Returns the address of the mapping, or -1.
+uint64 vmamap(struct proc *p, uint64 len, int prot, int flags,
+              struct file *f, uint off) {
+  if (len == 0 || len > TRAPFRAME || off % PAGE_SIZE != 0) return -1;
+  if (flags != MAP_SHARED && flags != MAP_PRIVATE) return -1;
+  if (f->type != FD_INODE || !f->readable) return -1;
+  if ((flags & MAP_SHARED) && (prot & PROT_WRITE) && !f->writable) return -1;
+
+  int perm = 0;
+  if (prot & PROT_READ) perm |= PAGE_TABLE_ENTRY_FLAGS_READABLE;
+  // risc-v has no write-only pages.
+  if (prot & PROT_WRITE)
+    perm |= PAGE_TABLE_ENTRY_FLAGS_READABLE | PAGE_TABLE_ENTRY_FLAGS_WRITABLE;
+  if (prot & PROT_EXEC) perm |= PAGE_TABLE_ENTRY_FLAGS_EXECUTABLE;
+  if (perm == 0) return -1;
+
+  // place the mapping as high as possible, leaving the
+  // space above the heap free for sbrk().
+  len = PAGE_ROUND_UP(len);
+  uint64 end = TRAPFRAME;
+  for (;;) {
+    if (end < len || end - len < PAGE_ROUND_UP(p->sz)) return -1;
+    struct vma *o = vmaoverlap(p, end - len, end);
+    if (o == 0) break;
+    end = o->start;
+  }
+
+  // only the part of the range inside the file comes from it;
+  // vmafill() zero-fills the rest, including the tail of the
+  // file's last page, which it copies rather than sharing.
+  ilock(f->ip);
+  uint size = f->ip->size;
+  iunlock(f->ip);
+  uint filesz = 0;
+  if (off < size) filesz = size - off < len ? size - off : len;
+
+  for (struct vma *v = p->vma; v < &p->vma[NVMA]; v++) {
+    if (v->ip) continue;
+    v->start = end - len;
+    v->end = end;
+    v->ip = idup(f->ip);
+    v->off = off;
+    v->filesz = filesz;
+    v->raoff = v->raend = off;
+    v->perm = perm;
+    v->flags = flags;
+    return v->start;
+  }
+  return -1;
+}
+
+// Remove the mappings of p in [addr, addr+len), writing
+// dirty shared pages back to their files. addr must be
+// page-aligned. Returns 0 on success, -1 on error.
+int vmaunmap(struct proc *p, uint64 addr, uint64 len) {
+  if (addr % PAGE_SIZE != 0 || addr + len < addr || addr + len > TRAPFRAME)
+    return -1;
+  uint64 end = PAGE_ROUND_UP(addr + len);
+
+  struct vma *v;
+  while ((v = vmaoverlap(p, addr, end)) != 0) {
+    uint64 a = addr > v->start ? addr : v->start;
+    uint64 b = end < v->end ? end : v->end;
+
+    if (a > v->start && b < v->end) {
+      // a hole in the middle: the part above it needs its own VMA.
+      struct vma *w = p->vma;
+      while (w < &p->vma[NVMA] && w->ip) w++;
+      if (w == &p->vma[NVMA]) return -1;
+      *w = *v;
+      w->start = b;
+      w->off += b - v->start;
+      w->filesz = v->filesz > b - v->start ? v->filesz - (b - v->start) : 0;
+      idup(w->ip);
+      v->end = b;
+    }
+
+    if (v->flags & MAP_SHARED) writeback(p->pagetable, v, a, b);
+    uvmunmap(p->pagetable, a, (b - a) / PAGE_SIZE, 1);
+
+    if (a == v->start && b == v->end) {
+      begin_op();
+      iput(v->ip);
+      end_op();
+      v->ip = 0;
+    } else if (a == v->start) {
+      v->off += b - v->start;
+      v->filesz = v->filesz > b - v->start ? v->filesz - (b - v->start) : 0;
+      v->start = b;
+    } else {
+      if (v->filesz > a - v->start) v->filesz = a - v->start;
+      v->end = a;
+    }
+  }
+  return 0;
+}
@@ -44,6 +44,8 @@ void rinode(uint inum, struct dinode *ip);
 void rsect(uint sec, void *buf);
 uint ialloc(ushort type);
 void iappend(uint inum, void *p, int n);
+uint bmap(struct dinode *din, uint fbn);
+void wdir(uint inum, uint parent, struct dirent *de, int n);
 
 // convert to intel byte order
 ushort xshort(ushort x) {
@@ -65,15 +67,24 @@ uint xint(uint x) {
 }
 
 int main(int argc, char *argv[]) {
-  uint rootino, off;
-  struct dirent de;
+  uint rootino;
+  struct dirent de[NINODES];
+  int nde = 0;
   char buf[BSIZE];
-  struct dinode din;
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if (argc > 2 && strcmp(argv[1], "-l") == 0) {
+    nlog = atoi(argv[2]);
+    argc -= 2;
+    argv += 2;
+  }
   if (argc < 2) {
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-l nlog] fs.img files...\n");
+    exit(1);
+  }
+  if (LOGTXMAX(nlog) < MAXOPBLOCKS * 3 || LOGTXMAX(nlog) > LOGMAX) {
+    fprintf(stderr, "mkfs: log of %d blocks is too small or too big\n", nlog);
     exit(1);
   }
 
@@ -89,6 +100,7 @@ int main(int argc, char *argv[]) {
   // 1 fs block = 1 disk sector
   nmeta = 2 + nlog + ninodeblocks + nbitmap;
   nblocks = FSSIZE - nmeta;
+  assert(nblocks > 0);
 
   sb.magic = FSMAGIC;
   sb.size = xint(FSSIZE);
@@ -115,16 +127,6 @@ int main(int argc, char *argv[]) {
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
-
   for (int i = 2; i < argc; i++) {
     int cc, fd;
     uint inum;
@@ -145,22 +147,18 @@ int main(int argc, char *argv[]) {
 
     inum = ialloc(T_FILE);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, shortname, DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
+    assert(nde < NINODES);
+    bzero(&de[nde], sizeof(de[nde]));
+    de[nde].inum = xshort(inum);
+    strncpy(de[nde].name, shortname, DIRSIZ);
+    nde++;
 
     while ((cc = read(fd, buf, sizeof(buf))) > 0) iappend(inum, buf, cc);
 
     close(fd);
   }
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off / BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  wdir(rootino, rootino, de, nde);
 
   balloc(freeblock);
 
@@ -237,12 +235,47 @@ void balloc(int used) {
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the block holding block fbn of the file with inode din,
+// allocating it, and indirect blocks on the way to it, if needed.
+uint bmap(struct dinode *din, uint fbn) {
+  uint indirect[NINDIRECT];
+
+  if (fbn < NDIRECT) {
+    if (xint(din->addrs[fbn]) == 0) din->addrs[fbn] = xint(freeblock++);
+    return xint(din->addrs[fbn]);
+  }
+  fbn -= NDIRECT;
+
+  int level = 0;
+  uint span = NINDIRECT;
+  while (fbn >= span) {
+    fbn -= span;
+    span *= NINDIRECT;
+    level++;
+  }
+  assert(level < NLEVEL);
+
+  if (xint(din->addrs[NDIRECT + level]) == 0)
+    din->addrs[NDIRECT + level] = xint(freeblock++);
+  uint x = xint(din->addrs[NDIRECT + level]);
+  do {
+    span /= NINDIRECT;
+    rsect(x, (char *)indirect);
+    if (indirect[fbn / span] == 0) {
+      indirect[fbn / span] = xint(freeblock++);
+      wsect(x, (char *)indirect);
+    }
+    x = xint(indirect[fbn / span]);
+    fbn %= span;
+  } while (span > 1);
+  return x;
+}
+
 void iappend(uint inum, void *xp, int n) {
   char *p = (char *)xp;
   uint off;
   struct dinode din;
   char buf[BSIZE];
-  uint indirect[NINDIRECT];
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -252,18 +285,7 @@ void iappend(uint inum, void *xp, int n) {
     uint n1;
     uint x;
     assert(fbn < MAXFILE);
-    if (fbn < NDIRECT) {
-      if (xint(din.addrs[fbn]) == 0) din.addrs[fbn] = xint(freeblock++);
-      x = xint(din.addrs[fbn]);
-    } else {
-      if (xint(din.addrs[NDIRECT]) == 0) din.addrs[NDIRECT] = xint(freeblock++);
-      rsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      if (indirect[fbn - NDIRECT] == 0) {
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char *)indirect);
-      }
-      x = xint(indirect[fbn - NDIRECT]);
-    }
+    x = bmap(&din, fbn);
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
     bcopy(p, buf + off - (fbn * BSIZE), n1);
@@ -275,3 +297,64 @@ void iappend(uint inum, void *xp, int n) {
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Must match dirhash() in kernel/fs.c.
+uint dirhash(const char *name) {
+  uint h = 2166136261;
+  for (int i = 0; i < DIRSIZ && name[i]; i++) {
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+int dircmp(const void *a, const void *b) {
+  uint ha = dirhash(((struct dirent *)a)->name);
+  uint hb = dirhash(((struct dirent *)b)->name);
+  return ha < hb ? -1 : ha > hb;
+}
+
+// Write the contents of hashed directory inum, whose parent is
+// inode parent and which holds the n entries de: block 0 with ".",
+// ".." and the index, followed by the leaves, each filled half full
+// so that the kernel can add names without splitting them at once.
+void wdir(uint inum, uint parent, struct dirent *de, int n) {
+  struct dirent root[DPB], leaf[DPB];
+  struct dxentry *dx = (struct dxentry *)&root[2];
+  int nleaf = 0;
+
+  static_assert(sizeof(struct dxentry) == sizeof(struct dirent),
+                "Index entries must be the size of dirents!");
+  qsort(de, n, sizeof(de[0]), dircmp);
+
+  bzero(root, sizeof(root));
+  root[0].inum = xshort(inum);
+  strcpy(root[0].name, ".");
+  root[1].inum = xshort(parent);
+  strcpy(root[1].name, "..");
+  dx[0].magic = xshort(DXMAGIC);
+  // start a new leaf every DPB/2 names, but keep equal hashes together.
+  for (int i = 0, m = 0; i < n; i++) {
+    uint h = dirhash(de[i].name);
+    if (i == 0 || (m >= DPB / 2 && h != dirhash(de[i - 1].name))) {
+      assert(nleaf < NDXLEAF);
+      dx[nleaf].hash = xint(i == 0 ? 0 : h);
+      dx[nleaf].leaf = xint(nleaf + 1);
+      nleaf++;
+      m = 0;
+    }
+    m++;
+    assert(m <= DPB);
+  }
+  dx[0].nleaf = xint(nleaf);
+  iappend(inum, root, sizeof(root));
+
+  for (int l = 0, i = 0; l < nleaf; l++) {
+    bzero(leaf, sizeof(leaf));
+    for (int m = 0; i < n; i++, m++) {
+      if (l + 1 < nleaf && dirhash(de[i].name) >= xint(dx[l + 1].hash)) break;
+      leaf[m] = de[i];
+    }
+    iappend(inum, leaf, sizeof(leaf));
+  }
+}
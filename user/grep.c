@@ -11,6 +11,22 @@ bool match(char *, char *);
 void grep(char *pattern, int fd) {
   int n, m = 0;
   char buf[1024];
+  char *map;
+
+  // search a regular file in place in the page cache.
+  // match() stops at the '\n' that ends each line.
+  if ((map = mapfile(fd, &n)) != 0) {
+    char *p = map, *q;
+    for (;;) {
+      for (q = p; q < map + n && *q != '\n'; q++)
+        ;
+      if (q == map + n) break;
+      if (match(pattern, p)) write(1, p, q + 1 - p);
+      p = q + 1;
+    }
+    munmap(map, n);
+    return;
+  }
 
   while ((n = read(fd, buf + m, sizeof(buf) - m - 1)) > 0) {
     char *p, *q;
@@ -61,6 +77,9 @@ int main(int argc, char *argv[]) {
 // Regexp matcher from Kernighan & Pike,
 // The Practice of Programming, Chapter 9.
 
+// Text ends at a '\0' or a '\n'.
+#define END(c) ((c) == '\0' || (c) == '\n')
+
 bool matchhere(char *, char *);
 bool matchstar(int, char *, char *);
 
@@ -68,7 +87,7 @@ bool match(char *regexp, char *text) {
   if (regexp[0] == '^') return matchhere(regexp + 1, text);
   do {  // must look at empty string
     if (matchhere(regexp, text)) return true;
-  } while (*text++ != '\0');
+  } while (!END(*text++));
   return false;
 }
 
@@ -76,8 +95,8 @@ bool match(char *regexp, char *text) {
 bool matchhere(char *regexp, char *text) {
   if (regexp[0] == '\0') return true;
   if (regexp[1] == '*') return matchstar(regexp[0], regexp + 2, text);
-  if (regexp[0] == '$' && regexp[1] == '\0') return *text == '\0';
-  if (*text != '\0' && (regexp[0] == '.' || regexp[0] == *text))
+  if (regexp[0] == '$' && regexp[1] == '\0') return END(*text);
+  if (!END(*text) && (regexp[0] == '.' || regexp[0] == *text))
     return matchhere(regexp + 1, text + 1);
   return false;
 }
@@ -86,6 +105,6 @@ bool matchhere(char *regexp, char *text) {
 bool matchstar(int c, char *regexp, char *text) {
   do {  // a * matches zero or more instances
     if (matchhere(regexp, text)) return true;
-  } while (*text != '\0' && (*text++ == c || c == '.'));
+  } while (!END(*text) && (*text++ == c || c == '.'));
   return false;
 }
@@ -0,0 +1,32 @@
+#include "kernel/diskstat.h"
+#include "kernel/fs.h"
+#include "kernel/types.h"
+#include "user/user.h"
+
+// Print how many blocks the disk has transferred, in how many
+// requests, and how many blocks the I/O scheduler merged into
+// the requests of their neighbours; then how long transfers took,
+// for waits that slept and waits that polled the disk.
+int main(void) {
+  struct diskstat st;
+
+  if (diskstat(&st) < 0) {
+    fprintf(2, "iostat: diskstat failed\n");
+    exit(1);
+  }
+  uint64 blocks = st.nread + st.nwrite;
+  printf("blocks read %l written %l, in %l requests\n", st.nread, st.nwrite,
+         st.nreq);
+  if (st.nreq > 0)
+    printf("average request %l bytes, %l%% of blocks merged\n",
+           blocks * BSIZE / st.nreq, (blocks - st.nreq) * 100 / blocks);
+
+  printf("latency from (us): sleeping waits, polling waits\n");
+  for (int i = 0; i < NDISKLAT; i++) {
+    if (st.sleeplat[i] == 0 && st.polllat[i] == 0) continue;
+    printf("%d: %l, %l\n", i == 0 ? 0 : 1 << i, st.sleeplat[i],
+           st.polllat[i]);
+  }
+  printf("polls that slept: %l\n", st.npollslept);
+  exit(0);
+}
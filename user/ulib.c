@@ -92,3 +92,17 @@ int memcmp(const void *s1, const void *s2, uint n) {
 void *memcpy(void *dst, const void *src, uint n) {
   return memmove(dst, src, n);
 }
+
+// Map the regular file open on fd into memory read-only, and set
+// *n to its size. Returns 0 if fd is not a non-empty regular file
+// or cannot be mapped, in which case the caller should read() it.
+// Undo with munmap(p, *n).
+char *mapfile(int fd, int *n) {
+  struct stat st;
+
+  if (fstat(fd, &st) < 0 || st.type != T_FILE || st.size == 0) return 0;
+  char *p = mmap(0, st.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == (char *)-1) return 0;
+  *n = st.size;
+  return p;
+}
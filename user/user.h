@@ -1,5 +1,6 @@
 #include "kernel/types.h"
 
+struct diskstat;
 struct stat;
 struct rtcdate;
 
@@ -25,6 +26,10 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+void* mmap(void*, uint64, int, int, int, uint);
+int munmap(void*, uint64);
+int fsync(int);
+int diskstat(struct diskstat*);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -42,3 +47,4 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void*, const void*, uint);
 void* memcpy(void*, const void*, uint);
+char* mapfile(int, int*);
@@ -1,3 +1,4 @@
+#include "kernel/diskstat.h"
 #include "kernel/fcntl.h"
 #include "kernel/fs.h"
 #include "kernel/memlayout.h"
@@ -538,7 +539,9 @@ void writetest(char *s) {
   }
 }
 
+// a file that reaches into the double-indirect blocks.
 void writebig(char *s) {
+  enum { NBIG = NDIRECT + NINDIRECT + 2 * NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE | O_RDWR);
@@ -547,7 +550,7 @@ void writebig(char *s) {
     exit(1);
   }
 
-  for (i = 0; i < MAXFILE; i++) {
+  for (i = 0; i < NBIG; i++) {
     ((int *)buf)[0] = i;
     if (write(fd, buf, BSIZE) != BSIZE) {
       printf("%s: error: write big file failed\n", s, i);
@@ -567,7 +570,7 @@ void writebig(char *s) {
   for (;;) {
     i = read(fd, buf, BSIZE);
     if (i == 0) {
-      if (n == MAXFILE - 1) {
+      if (n != NBIG) {
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -1968,6 +1971,747 @@ void forktest(char *s) {
   }
 }
 
+// fork a process that uses most of memory, which only works if
+// the child shares the parent's pages copy-on-write. stores by
+// the child, and copyout() into a shared page, must not be seen
+// by the parent.
+void cowfork(char *s) {
+  enum { SZ = 80 * 1024 * 1024 };
+  int fds[2], xstatus;
+
+  char *p = sbrk(SZ);
+  if (p == (char *)0xffffffffffffffffL) {
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  int me = getpid();
+  for (char *q = p; q < p + SZ; q += PAGE_SIZE) *(int *)q = me;
+
+  if (pipe(fds) < 0) {
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  int pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    for (char *q = p; q < p + SZ; q += PAGE_SIZE) {
+      if (*(int *)q != me) {
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    for (char *q = p; q < p + SZ; q += 16 * PAGE_SIZE) *(int *)q = 0;
+    if (read(fds[0], p + PAGE_SIZE, 1) != 1) exit(1);
+    exit(0);
+  }
+  if (write(fds[1], "x", 1) != 1) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) exit(1);
+  for (char *q = p; q < p + SZ; q += PAGE_SIZE) {
+    if (*(int *)q != me) {
+      printf("%s: parent sees child's store\n", s);
+      exit(1);
+    }
+  }
+  close(fds[0]);
+  close(fds[1]);
+  sbrk(-SZ);
+}
+
+// stress the per-CPU page allocator: one process per CPU allocates,
+// touches, and frees pages and forks at the same time, so that pages
+// keep moving between the harts' free lists and the shared pool.
+void kallocstress(char *s) {
+  enum { NCHILD = CPU_MAX_NUM, ROUNDS = 50, NPAGES = 32 };
+  int xstatus;
+
+  for (int i = 0; i < NCHILD; i++) {
+    int pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid != 0) continue;
+
+    for (int r = 0; r < ROUNDS; r++) {
+      char *a = sbrk(NPAGES * PAGE_SIZE);
+      if (a == (char *)0xffffffffffffffffL) {
+        printf("%s: sbrk failed\n", s);
+        exit(1);
+      }
+      for (int p = 0; p < NPAGES; p++) a[p * PAGE_SIZE] = i + r + p;
+      for (int p = 0; p < NPAGES; p++) {
+        if (a[p * PAGE_SIZE] != (char)(i + r + p)) {
+          printf("%s: page %d changed under us\n", s, p);
+          exit(1);
+        }
+      }
+      int pid1 = fork();
+      if (pid1 < 0) {
+        printf("%s: fork failed\n", s);
+        exit(1);
+      }
+      if (pid1 == 0) exit(0);
+      wait(0);
+      sbrk(-NPAGES * PAGE_SIZE);
+    }
+    exit(0);
+  }
+
+  for (int i = 0; i < NCHILD; i++) {
+    wait(&xstatus);
+    if (xstatus != 0) exit(1);
+  }
+}
+
+// sbrk() should only reserve address space; pages are
+// allocated and zeroed when they are first touched.
+void sbrklazy(char *s) {
+  enum { SZ = 1024 * 1024 * 1024, STRIDE = 64 * 1024 * 1024 };
+
+  char *p = sbrk(SZ);
+  if (p == (char *)0xffffffffffffffffL) {
+    printf("%s: sbrk of a large heap failed\n", s);
+    exit(1);
+  }
+  for (char *q = p; q < p + SZ; q += STRIDE) {
+    if (*q != 0) {
+      printf("%s: lazy page not zero\n", s);
+      exit(1);
+    }
+    *q = 'x';
+  }
+  for (char *q = p; q < p + SZ; q += STRIDE) {
+    if (*q != 'x' || *(q + PAGE_SIZE) != 0) {
+      printf("%s: lazy page lost a store\n", s);
+      exit(1);
+    }
+  }
+  if (sbrk(-SZ) != p + SZ) {
+    printf("%s: sbrk shrink failed\n", s);
+    exit(1);
+  }
+}
+
+// mmap() of a file: stores to a MAP_PRIVATE mapping stay in
+// memory, while stores to a MAP_SHARED mapping are shared with
+// children and reach the file on munmap() and exit().
+void mmaptest(char *s) {
+  enum { SZ = 2 * PAGE_SIZE + PAGE_SIZE / 2 };
+  char *f = "mmap.dur";
+  int fd, pid, xstatus;
+  char *p;
+
+  unlink(f);
+  fd = open(f, O_CREATE | O_RDWR);
+  if (fd < 0) {
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i++) buf[i] = 'a' + i % 26;
+  if (write(fd, buf, SZ) != SZ) {
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == (char *)-1) {
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i++) {
+    if (p[i] != 'a' + i % 26) {
+      printf("%s: mapping has wrong data\n", s);
+      exit(1);
+    }
+  }
+  if (p[SZ] != 0) {
+    printf("%s: mapping past end of file not zero\n", s);
+    exit(1);
+  }
+  p[0] = 'P';
+  if (munmap(p, SZ) < 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(f, O_RDWR);
+  if (read(fd, buf, 1) != 1 || buf[0] != 'a') {
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == (char *)-1) {
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  for (int i = 0; i < SZ; i += PAGE_SIZE) {
+    if (p[i] != 'a' + i % 26) {
+      printf("%s: mapping has wrong data\n", s);
+      exit(1);
+    }
+  }
+  p[0] = 'S';
+  p[SZ - 1] = 'E';
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    p[PAGE_SIZE] = 'C';
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) exit(1);
+  if (p[PAGE_SIZE] != 'C') {
+    printf("%s: parent does not see child's store\n", s);
+    exit(1);
+  }
+  if (munmap(p, SZ) < 0) {
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    // exit() without munmap() writes the page back.
+    fd = open(f, O_RDWR);
+    p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == (char *)-1) exit(1);
+    p[1] = 'X';
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0) exit(1);
+
+  fd = open(f, O_RDONLY);
+  if (read(fd, buf, BUFSZ) != SZ) {
+    printf("%s: file size changed\n", s);
+    exit(1);
+  }
+  if (buf[0] != 'S' || buf[1] != 'X' || buf[PAGE_SIZE] != 'C' ||
+      buf[SZ - 1] != 'E') {
+    printf("%s: shared store did not reach the file\n", s);
+    exit(1);
+  }
+  if (mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != (char *)-1) {
+    printf("%s: writable shared mapping of read-only file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
+// MAP_SHARED mappings of a file by different processes, and
+// read() and write() of it, all see the same page cache pages.
+void mmapcoherent(char *s) {
+  enum { SZ = 2 * PAGE_SIZE };
+  char *f = "mmapc.dur";
+  int fd, pid, xstatus;
+  char *p;
+
+  unlink(f);
+  fd = open(f, O_CREATE | O_RDWR);
+  memset(buf, 'a', SZ);
+  if (fd < 0 || write(fd, buf, SZ) != SZ) {
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == (char *)-1) {
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  if (p[0] != 'a') {
+    printf("%s: mapping has wrong data\n", s);
+    exit(1);
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if (pid == 0) {
+    // a mapping of its own, not the one inherited from the parent.
+    int fd1 = open(f, O_RDWR);
+    char *q = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd1, 0);
+    if (q == (char *)-1 || q == p) exit(1);
+    q[0] = 'c';
+    exit(0);
+  }
+  wait(&xstatus);
+  if (xstatus != 0 || p[0] != 'c') {
+    printf("%s: store by another process not seen\n", s);
+    exit(1);
+  }
+
+  int fd1 = open(f, O_RDWR);
+  if (write(fd1, "cw", 2) != 2 || p[1] != 'w') {
+    printf("%s: write() not seen through mapping\n", s);
+    exit(1);
+  }
+  close(fd1);
+  p[PAGE_SIZE] = 's';
+  fd1 = open(f, O_RDONLY);
+  if (read(fd1, buf, SZ) != SZ || buf[PAGE_SIZE] != 's') {
+    printf("%s: store through mapping not seen by read()\n", s);
+    exit(1);
+  }
+  close(fd1);
+  munmap(p, SZ);
+  close(fd);
+  unlink(f);
+}
+
+// a mapping that runs past the end of its file reads zeros
+// there, and stores there stay out of the file and out of
+// later mappings of it.
+void mmapeof(char *s) {
+  enum { SZ = 10, LEN = 3 * PAGE_SIZE };
+  char *f = "mmap.eof";
+  int fd;
+  char *p;
+
+  unlink(f);
+  fd = open(f, O_CREATE | O_RDWR);
+  if (fd < 0 || write(fd, "0123456789", SZ) != SZ) {
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+
+  for (int round = 0; round < 2; round++) {
+    int flags = round == 0 ? MAP_SHARED : MAP_PRIVATE;
+    p = mmap(0, LEN, PROT_READ | PROT_WRITE, flags, fd, 0);
+    if (p == (char *)-1) {
+      printf("%s: mmap failed\n", s);
+      exit(1);
+    }
+    if (p[0] != '0' || p[SZ - 1] != '9') {
+      printf("%s: mapping has wrong data\n", s);
+      exit(1);
+    }
+    for (int i = SZ; i < LEN; i++) {
+      if (p[i] != 0) {
+        printf("%s: mapping past end of file not zero at %d\n", s, i);
+        exit(1);
+      }
+    }
+    p[SZ] = 'x';
+    p[PAGE_SIZE + 1] = 'y';
+    if (munmap(p, LEN) < 0) {
+      printf("%s: munmap failed\n", s);
+      exit(1);
+    }
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.size != SZ) {
+    printf("%s: file size changed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+}
+
+// concurrent writers while the log flusher commits in the
+// background; fsync() must wait for their data to be on disk.
+void fsynctest(char *s) {
+  enum { N = 4, SZ = BUFSZ };
+  char name[] = "fsync0";
+  int xstatus;
+
+  if (fsync(-1) != -1 || fsync(NOFILE) != -1) {
+    printf("%s: fsync of a bad fd succeeded\n", s);
+    exit(1);
+  }
+
+  for (int i = 0; i < N; i++) {
+    int pid = fork();
+    if (pid < 0) {
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if (pid == 0) {
+      name[5] = '0' + i;
+      unlink(name);
+      int fd = open(name, O_CREATE | O_RDWR);
+      memset(buf, 'a' + i, SZ);
+      if (fd < 0 || write(fd, buf, SZ) != SZ || fsync(fd) != 0) exit(1);
+      close(fd);
+      exit(0);
+    }
+  }
+  for (int i = 0; i < N; i++) {
+    wait(&xstatus);
+    if (xstatus != 0) {
+      printf("%s: writer failed\n", s);
+      exit(1);
+    }
+  }
+
+  for (int i = 0; i < N; i++) {
+    name[5] = '0' + i;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0 || read(fd, buf, SZ) != SZ || buf[0] != 'a' + i ||
+        buf[SZ - 1] != 'a' + i) {
+      printf("%s: %s has wrong data\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    unlink(name);
+  }
+}
+
+// free a file's indirect block and allocate file data in the
+// same transaction. the new data must not take the freed blocks
+// before the transaction commits, and the freed blocks must be
+// usable again afterwards.
+void freereuse(char *s) {
+  enum { NB = NDIRECT + 4 };
+  int fd;
+
+  for (int round = 0; round < 3; round++) {
+    unlink("fr.old");
+    if ((fd = open("fr.old", O_CREATE | O_WRONLY)) < 0) {
+      printf("%s: create fr.old failed\n", s);
+      exit(1);
+    }
+    memset(buf, 'o', BSIZE);
+    for (int i = 0; i < NB; i++) {
+      if (write(fd, buf, BSIZE) != BSIZE) {
+        printf("%s: write fr.old failed\n", s);
+        exit(1);
+      }
+    }
+    if (fsync(fd) != 0) {
+      printf("%s: fsync fr.old failed\n", s);
+      exit(1);
+    }
+    close(fd);
+
+    // in one transaction, if the flusher does not get between them.
+    if (unlink("fr.old") != 0 ||
+        (fd = open("fr.new", O_CREATE | O_RDWR)) < 0) {
+      printf("%s: unlink fr.old or create fr.new failed\n", s);
+      exit(1);
+    }
+    for (int i = 0; i < NB; i++) {
+      memset(buf, 'a' + i % 26, BSIZE);
+      if (write(fd, buf, BSIZE) != BSIZE) {
+        printf("%s: write fr.new failed\n", s);
+        exit(1);
+      }
+    }
+    if (fsync(fd) != 0) {
+      printf("%s: fsync fr.new failed\n", s);
+      exit(1);
+    }
+    close(fd);
+
+    if ((fd = open("fr.new", O_RDONLY)) < 0) {
+      printf("%s: open fr.new failed\n", s);
+      exit(1);
+    }
+    for (int i = 0; i < NB; i++) {
+      if (read(fd, buf, BSIZE) != BSIZE || buf[0] != 'a' + i % 26 ||
+          buf[BSIZE - 1] != 'a' + i % 26) {
+        printf("%s: fr.new has wrong data in block %d\n", s, i);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink("fr.new");
+  }
+}
+
+// a directory large enough that its entries are spread over
+// many leaf blocks, which split as names are added.
+void hashdir(char *s) {
+  enum { N = 1000 };
+  char name[] = "hd/x000";
+  struct dirent de;
+  int fd, n;
+
+  if (mkdir("hd") != 0 || (fd = open("hd/f", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create hd/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for (int i = 0; i < N; i++) {
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if (link("hd/f", name) != 0) {
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  // every entry is read back once, and no index entry shows.
+  fd = open("hd", O_RDONLY);
+  n = 0;
+  while (read(fd, &de, sizeof(de)) == sizeof(de)) {
+    if (de.inum == 0) continue;
+    if (de.name[0] != 'x' && strcmp(de.name, "f") != 0 &&
+        strcmp(de.name, ".") != 0 && strcmp(de.name, "..") != 0) {
+      printf("%s: weird entry %s\n", s, de.name);
+      exit(1);
+    }
+    n++;
+  }
+  close(fd);
+  if (n != N + 3) {
+    printf("%s: read %d entries, expected %d\n", s, n, N + 3);
+    exit(1);
+  }
+
+  if (open("hd/x1000", O_RDONLY) >= 0 || link("hd/f", "hd/x999") == 0) {
+    printf("%s: found a missing name or linked a present one\n", s);
+    exit(1);
+  }
+
+  for (int i = 0; i < N; i++) {
+    name[4] = '0' + i / 100;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if (unlink(name) != 0) {
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if (unlink("hd/f") != 0 || unlink("hd") != 0) {
+    printf("%s: unlink hd failed\n", s);
+    exit(1);
+  }
+}
+
+// a hashed directory with more leaves than block 0 can index, so
+// that the index grows a second level, and its index blocks split.
+void hugedir(char *s) {
+  enum { N = 4500 };
+  char name[] = "hg/x0000";
+  int fd;
+
+  if (mkdir("hg") != 0 || (fd = open("hg/f", O_CREATE | O_RDWR)) < 0) {
+    printf("%s: create hg/f failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  for (int i = 0; i < N; i++) {
+    name[4] = '0' + i / 1000;
+    name[5] = '0' + i / 100 % 10;
+    name[6] = '0' + i / 10 % 10;
+    name[7] = '0' + i % 10;
+    if (link("hg/f", name) != 0) {
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+
+  if (open("hg/x9999", O_RDONLY) >= 0 || link("hg/f", "hg/x0999") == 0) {
+    printf("%s: found a missing name or linked a present one\n", s);
+    exit(1);
+  }
+
+  for (int i = 0; i < N; i++) {
+    name[4] = '0' + i / 1000;
+    name[5] = '0' + i / 100 % 10;
+    name[6] = '0' + i / 10 % 10;
+    name[7] = '0' + i % 10;
+    if ((fd = open(name, O_RDONLY)) < 0) {
+      printf("%s: open %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+    if (unlink(name) != 0) {
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  if (unlink("hg/f") != 0 || unlink("hg") != 0) {
+    printf("%s: unlink hg failed\n", s);
+    exit(1);
+  }
+}
+
+// lookups cached by the kernel's name cache, both of names that
+// exist and of names that don't, must follow creates and unlinks,
+// also when a removed directory's inode is reused.
+void dcachetest(char *s) {
+  int fd;
+
+  for (int i = 0; i < 3; i++) {
+    if (open("dc/f", O_RDONLY) >= 0 || open("dc", O_RDONLY) >= 0) {
+      printf("%s: opened dc/f before creating it\n", s);
+      exit(1);
+    }
+    if (mkdir("dc") != 0 || (fd = open("dc/f", O_CREATE | O_RDWR)) < 0) {
+      printf("%s: create dc/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if ((fd = open("dc/f", O_RDONLY)) < 0) {
+      printf("%s: open dc/f failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if (link("dc/f", "dc/g") != 0 || unlink("dc/f") != 0 ||
+        open("dc/f", O_RDONLY) >= 0 || (fd = open("dc/g", O_RDONLY)) < 0) {
+      printf("%s: lookup after link and unlink is stale\n", s);
+      exit(1);
+    }
+    close(fd);
+    if (unlink("dc/g") != 0 || unlink("dc") != 0) {
+      printf("%s: unlink dc failed\n", s);
+      exit(1);
+    }
+  }
+}
+
+// two descriptors read a file sequentially, in small pieces, while
+// the kernel reads ahead of each of them.
+void readahead(char *s) {
+  enum { NB = 40 };
+  char *f = "ra";
+  int fd, fds[2];
+
+  unlink(f);
+  if ((fd = open(f, O_CREATE | O_WRONLY)) < 0) {
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  for (int i = 0; i < NB; i++) {
+    memset(buf, i, BSIZE);
+    if (write(fd, buf, BSIZE) != BSIZE) {
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  fds[0] = open(f, O_RDONLY);
+  fds[1] = open(f, O_RDONLY);
+  if (fds[0] < 0 || fds[1] < 0) {
+    printf("%s: open %s failed\n", s, f);
+    exit(1);
+  }
+  for (int off = 0; off < NB * BSIZE; off += 100) {
+    int n = off + 100 > NB * BSIZE ? NB * BSIZE - off : 100;
+    for (int j = 0; j < 2; j++) {
+      if (read(fds[j], buf, n) != n) {
+        printf("%s: short read at %d\n", s, off);
+        exit(1);
+      }
+      for (int i = 0; i < n; i++) {
+        if (buf[i] != (char)((off + i) / BSIZE)) {
+          printf("%s: wrong data at %d\n", s, off + i);
+          exit(1);
+        }
+      }
+    }
+  }
+  if (read(fds[0], buf, 1) != 0 || read(fds[1], buf, 1) != 0) {
+    printf("%s: read past the end\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  unlink(f);
+}
+
+// the blocks of a large sequential write should reach
+// the disk merged into fewer requests.
+void diskmerge(char *s) {
+  enum { NB = 64 };
+  char *f = "dm";
+  struct diskstat st0, st1;
+  int fd;
+
+  unlink(f);
+  if ((fd = open(f, O_CREATE | O_WRONLY)) < 0) {
+    printf("%s: create %s failed\n", s, f);
+    exit(1);
+  }
+  if (diskstat(&st0) < 0) {
+    printf("%s: diskstat failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'm', BSIZE);
+  for (int i = 0; i < NB; i++) {
+    if (write(fd, buf, BSIZE) != BSIZE) {
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  if (fsync(fd) < 0 || diskstat(&st1) < 0) {
+    printf("%s: fsync or diskstat failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(f);
+
+  uint64 blocks = st1.nwrite - st0.nwrite;
+  uint64 nreq = st1.nreq - st0.nreq;
+  if (blocks < NB) {
+    printf("%s: %l blocks written, expected at least %d\n", s, blocks, NB);
+    exit(1);
+  }
+  if (nreq * 2 > blocks) {
+    printf("%s: %l blocks took %l requests\n", s, blocks, nreq);
+    exit(1);
+  }
+}
+
+// a log commit waits for its disk writes by polling, so
+// fsync() should add to the polling latency histogram.
+void diskpoll(char *s) {
+  struct diskstat st0, st1;
+  uint64 n0 = 0, n1 = 0;
+  int fd;
+
+  if ((fd = open("dp", O_CREATE | O_WRONLY)) < 0) {
+    printf("%s: create dp failed\n", s);
+    exit(1);
+  }
+  if (diskstat(&st0) < 0 || write(fd, "x", 1) != 1 || fsync(fd) < 0 ||
+      diskstat(&st1) < 0) {
+    printf("%s: write, fsync or diskstat failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("dp");
+
+  for (int i = 0; i < NDISKLAT; i++) {
+    n0 += st0.polllat[i];
+    n1 += st1.polllat[i];
+  }
+  if (n1 <= n0) {
+    printf("%s: no polled transfers\n", s);
+    exit(1);
+  }
+}
+
 void sbrkbasic(char *s) {
   enum { TOOMUCH = 1024 * 1024 * 1024 };
   int i, pid, xstatus;
@@ -2669,7 +3413,21 @@ int main(int argc, char *argv[]) {
       {dirfile, "dirfile"},
       {iref, "iref"},
       {forktest, "forktest"},
-      {bigdir, "bigdir"},  // slow
+      {kallocstress, "kallocstress"},
+      {cowfork, "cowfork"},
+      {sbrklazy, "sbrklazy"},
+      {mmaptest, "mmaptest"},
+      {mmapcoherent, "mmapcoherent"},
+      {mmapeof, "mmapeof"},
+      {fsynctest, "fsynctest"},
+      {freereuse, "freereuse"},
+      {hashdir, "hashdir"},
+      {dcachetest, "dcachetest"},
+      {readahead, "readahead"},
+      {diskmerge, "diskmerge"},
+      {diskpoll, "diskpoll"},
+      {bigdir, "bigdir"},    // slow
+      {hugedir, "hugedir"},  // slow
       {0, 0},
   };
 